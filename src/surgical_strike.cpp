@@ -22,33 +22,60 @@
 // Includes
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
+#include <osg/Geode>
+#include <osg/Geometry>
 #include <osg/Group>
+#include <osg/Image>
 #include <osg/LightModel>
 #include <osg/Material>
 #include <osg/MatrixTransform>
 #include <osg/Node>
 #include <osg/Texture2D>
 #include <osg/TexGen>
+#include <osg/Timer>
+#include <osg/Transform>
+#include <osg/TriangleIndexFunctor>
 #include <osg/Vec3f>
+#include <osg/Version>
 
 //#include <osg/ShapeDrawable>
 
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
 #include <osgDB/Registry>
 #include <osgDB/ReadFile>
 #include <osgDB/WriteFile>
 
+#include <osgUtil/Optimizer>
+
 #include <osgViewer/Viewer>
 
+#include "surgical_strike.h"
+#include "surgical_strike_codec.h"
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Externs
@@ -59,6 +86,75 @@ extern int yylineno;
 //TODO - Make this settable from the command line
 bool debug = true;
 
+// Weld, index and reorder payload meshes once when they are loaded
+bool optimize_payloads = true;
+
+// Where preprocessed camouflage textures are kept between runs.
+// If empty we use ~/.cache/surgical_strike/textures
+std::string texture_cache_directory = "";
+
+// Keep preprocessed camouflage textures on disk
+bool cache_textures = true;
+
+// Downscale camouflage images larger than this, or 0 for no limit
+int max_texture_size = 0;
+
+// Show the scene in a viewer once it has been written
+bool view_scene = true;
+
+// Which of shard_count processes this is. Each keeps only its own deliveries.
+int shard_index = 0;
+int shard_count = 1;
+
+enum ShardPartition
+{
+    SHARD_BY_INDEX,
+    SHARD_BY_SPACE
+};
+
+ShardPartition shard_partition = SHARD_BY_INDEX;
+
+// The size of the grid cells that deliveries are grouped into by space
+double shard_cell_size = 10.0;
+
+// Deliveries so far, including those belonging to other shards
+unsigned long delivery_count = 0;
+
+// Record deliveries in the instance buffer and build them all after execution
+bool defer_deliveries = false;
+
+// Set while the instance buffer is being turned into the scene
+bool delivering_deferred = false;
+
+// Resource budgets, 0 for unlimited. The codeword depth limit is on by
+// default as it is what stops a codeword that executes itself.
+unsigned long max_deliveries = 0;
+unsigned long max_codeword_depth = 1000;
+double max_seconds = 0.0;
+unsigned long max_memory_mb = 0;
+
+// Write whatever has been delivered when a budget is exceeded
+bool write_partial_scene = false;
+
+// The file the scene will be written to
+std::string output_file_name = "";
+
+// Reuse the output of earlier runs of the same program with the same assets
+bool cache_results = false;
+
+// Where earlier results are kept. If empty we use
+// ~/.cache/surgical_strike/results
+std::string result_cache_directory = "";
+
+// Evict the least recently used results when there are more than this
+unsigned long result_cache_size_mb = 1024;
+
+// The text of the program, which is only kept when caching results
+std::string program_text = "";
+
+// Precision of positions within each payload's bounds in compressed output
+int position_bits = 16;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Constants
@@ -66,6 +162,9 @@ bool debug = true;
 
 const char * MAIN = "Main entry point";
 
+// Changes whenever the output for a given program might
+const char * VERSION = "0.4";
+
 const double PI = 3.14159265;
 const double DEGS_TO_RADS = PI / 180.0;
 
@@ -145,151 +244,1374 @@ osg::Vec3d spherical_to_cartesian_radians (osg::Vec3d & spher, double scale)
     return osg::Vec3d(x, y, z);
 }
 
-osg::Vec3d spherical_to_cartesian (osg::Vec3d & spher, double scale)
+osg::Vec3d spherical_to_cartesian (osg::Vec3d & spher, double scale)
+{
+    osg::Vec3d rads(spher.x (),
+                    spher.y () * DEGS_TO_RADS,
+                    spher.z () * DEGS_TO_RADS);
+    return spherical_to_cartesian_radians(rads, scale);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Mesh processing
+// Loaders such as STL give us unindexed triangle soup, and every delivery
+// shares the payload's geometry, so tidy it up once when it is loaded.
+////////////////////////////////////////////////////////////////////////////////
+
+// Counts vertices and primitive indices so we can report what was saved
+
+struct MeshStatistics : public osg::NodeVisitor
+{
+    unsigned int vertices;
+    unsigned int indices;
+
+    MeshStatistics ()
+        : osg::NodeVisitor (osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+          vertices (0),
+          indices (0)
+    {}
+
+    virtual void apply (osg::Geode & geode)
+    {
+        for (unsigned int i = 0; i < geode.getNumDrawables (); i++)
+        {
+            osg::Geometry * geometry = geode.getDrawable (i)->asGeometry ();
+            if (geometry == NULL)
+                continue;
+            if (geometry->getVertexArray () != NULL)
+                vertices += geometry->getVertexArray ()->getNumElements ();
+            for (unsigned int j = 0; j < geometry->getNumPrimitiveSets (); j++)
+                indices += geometry->getPrimitiveSet (j)->getNumIndices ();
+        }
+        traverse (geode);
+    }
+};
+
+// The mesh optimizers skip geometry that uses per-primitive bindings or
+// array indices, which is what the older loaders produce, so expand those
+// to plain per-vertex arrays first.
+
+struct FixDeprecatedGeometry : public osg::NodeVisitor
+{
+    FixDeprecatedGeometry ()
+        : osg::NodeVisitor (osg::NodeVisitor::TRAVERSE_ALL_CHILDREN)
+    {}
+
+    virtual void apply (osg::Geode & geode)
+    {
+        for (unsigned int i = 0; i < geode.getNumDrawables (); i++)
+        {
+            osg::Geometry * geometry = geode.getDrawable (i)->asGeometry ();
+            if ((geometry != NULL) && geometry->containsDeprecatedData ())
+                geometry->fixDeprecatedData ();
+        }
+        traverse (geode);
+    }
+};
+
+// Weld duplicate vertices into indexed triangles, then reorder the triangles
+// for the post-transform vertex cache and the vertices for fetch locality.
+
+void optimize_payload (osg::Node * payload)
+{
+    assert (payload != NULL);
+
+    MeshStatistics before;
+    if (debug)
+        payload->accept (before);
+
+    FixDeprecatedGeometry fix;
+    payload->accept (fix);
+
+    osgUtil::Optimizer optimizer;
+    optimizer.optimize (payload,
+                        osgUtil::Optimizer::INDEX_MESH |
+                        osgUtil::Optimizer::VERTEX_POSTTRANSFORM |
+                        osgUtil::Optimizer::VERTEX_PRETRANSFORM);
+
+    if (debug)
+    {
+        MeshStatistics after;
+        payload->accept (after);
+        std::fprintf (stderr, "Optimized payload: %u vertices %u indices -> "
+                      "%u vertices %u indices.\n",
+                      before.vertices, before.indices,
+                      after.vertices, after.indices);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Current Transformation Matrix management
+////////////////////////////////////////////////////////////////////////////////
+
+osg::Vec3d & origin ()
+{
+    return origin_stack.back ();
+}
+
+osg::Vec3d & position ()
+{
+    return position_stack.back ();
+}
+
+osg::Vec3d cartesian_position ()
+{
+    double size = payload_sizes[current_payload];
+    return spherical_to_cartesian (position (), size);
+}
+
+osg::Vec3d & rotation ()
+{
+    return rotation_stack.back ();
+}
+
+osg::Vec3d & scale ()
+{
+    return scale_stack.back ();
+}
+
+osg::Matrixd origin_transform ()
+{
+    osg::Matrixd matrix;
+    matrix.makeTranslate (origin ());
+    return matrix;
+}
+
+osg::Matrixd origin_transform_from ()
+{
+    osg::Matrixd matrix;
+    matrix.makeTranslate (origin () + cartesian_position ());
+    return matrix;
+}
+
+osg::Matrixd origin_transform_to ()
+{
+    osg::Matrixd matrix;
+    matrix.makeTranslate (- (origin () + cartesian_position ()));
+    return matrix;
+}
+
+osg::Matrixd position_transform ()
+{
+    osg::Matrixd matrix;
+    matrix.makeTranslate (cartesian_position ());
+    return matrix;
+}
+
+osg::Matrixd rotation_transform ()
+{
+    osg::Vec3f rotate = rotation ();
+    osg::Matrixd matrix = origin_transform_to ();
+    if (rotate.x () != 0.0)
+    {
+        osg::Matrixd rotatex;
+        rotatex.makeRotate (rotate.x () * DEGS_TO_RADS, 1.0, 0, 0);
+        matrix *= rotatex;
+    }
+    if (rotate.y () != 0.0)
+    {
+        osg::Matrixd rotatey;
+        rotatey.makeRotate (rotate.y () * DEGS_TO_RADS, 0.0, 1.0, 0);
+        matrix *= rotatey;
+    }
+    if (rotate.z () != 0.0)
+    {
+        osg::Matrixd rotatez;
+        rotatez.makeRotate (rotate.z () * DEGS_TO_RADS, 0.0, 0.0, 1.0);
+        matrix  *= rotatez;
+    }
+
+    matrix *= origin_transform_from ();
+
+    return matrix;
+}
+
+osg::Matrixd scale_transform ()
+{
+    osg::Matrixd matrix;// = origin_transform_to ();
+
+    osg::Matrixd scaling;
+    scaling.makeScale (scale ());
+    matrix *= scaling;
+    
+    //matrix *= origin_transform_from ();
+    return matrix;
+}
+
+osg::Matrixd current_transform ()
+{
+    return origin_transform () *
+        position_transform () *
+        scale_transform () *
+        rotation_transform () ;
+}
+
+void push_transforms ()
+{
+    osg::Vec3d zero (0.0, 0.0, 0.0);
+    // FIXME: If you mark after loading a new model of a different size
+    // this will set the origin based on the new size.
+    // For the moment just make sure to load inside marks.
+    origin_stack.push_back (cartesian_position ());
+    position_stack.push_back (zero);
+    rotation_stack.push_back (rotation ());
+    scale_stack.push_back (scale ());
+}
+
+void pop_transforms ()
+{
+    origin_stack.pop_back ();
+    position_stack.pop_back ();
+    rotation_stack.pop_back ();
+    scale_stack.pop_back ();
+
+    //TODO: Issue helpful warning message
+    assert (! origin_stack.empty ());
+}
+
+void initialize_transforms ()
+{
+    osg::Vec3d zero (0.0, 0.0, 0.0);
+    origin_stack.push_back (zero);
+    position_stack.push_back (zero);
+    rotation_stack.push_back (zero);
+    osg::Vec3d one (1.0, 1.0, 1.0);
+    scale_stack.push_back (one);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// File utility
+////////////////////////////////////////////////////////////////////////////////
+
+bool file_exists (const std::string filename)
+{
+    bool exists = false;
+    int fd = open (filename.c_str (), O_RDONLY);
+    if (fd != -1)
+    {
+        close (fd);
+        exists = true;
+    }
+    return exists;
+}
+
+bool read_file_contents (const std::string & filename, std::string & contents)
+{
+    FILE * file = std::fopen (filename.c_str (), "rb");
+    if (file == NULL)
+        return false;
+    contents.clear ();
+    char buffer[65536];
+    size_t count;
+    while ((count = std::fread (buffer, 1, sizeof (buffer), file)) > 0)
+        contents.append (buffer, count);
+    bool ok = ! std::ferror (file);
+    std::fclose (file);
+    return ok;
+}
+
+// FNV-1a, which is plenty to tell our input files apart
+
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+uint64_t hash_bytes (const char * bytes, size_t length, uint64_t hash = HASH_SEED)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t hash_string (const std::string & text, uint64_t hash = HASH_SEED)
+{
+    // Include the length so concatenated strings hash differently
+    uint64_t length = text.size ();
+    hash = hash_bytes ((const char *) & length, sizeof (length), hash);
+    return hash_bytes (text.data (), text.size (), hash);
+}
+
+std::string hash_to_string (uint64_t hash)
+{
+    char buffer[17];
+    std::snprintf (buffer, sizeof (buffer), "%016llx",
+                   (unsigned long long) hash);
+    return buffer;
+}
+
+// ~/.cache/surgical_strike/<subdirectory>, or "" if we have no home
+
+std::string default_cache_directory (const std::string & subdirectory)
+{
+    std::string root;
+    const char * xdg = std::getenv ("XDG_CACHE_HOME");
+    const char * home = std::getenv ("HOME");
+    if ((xdg != NULL) && (xdg[0] != '\0'))
+        root = xdg;
+    else if ((home != NULL) && (home[0] != '\0'))
+        root = std::string (home) + "/.cache";
+    else
+        return "";
+    return root + "/surgical_strike/" + subdirectory;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Camouflage texture preprocessing
+// PNG decoding and mipmap generation are the same every run, so we do them
+// once and keep the full mip chain in a small KTX-like file named after the
+// hash of the source image's bytes. The file is:
+//   magic, endianness check, width, height, internal format, pixel format,
+//   data type, level count, then for each level its byte size and pixels.
+// Levels are tightly packed (packing 1) 8-bit per channel pixels.
+////////////////////////////////////////////////////////////////////////////////
+
+const char TEXTURE_CACHE_MAGIC[8] = {'S', 'S', 'T', 'E', 'X', '0', '1', '\n'};
+const uint32_t TEXTURE_CACHE_ENDIANNESS = 0x04030201;
+// Larger than any GL implementation takes, and small enough that the
+// largest level's byte size fits in an int
+const uint32_t MAX_TEXTURE_CACHE_DIMENSION = 16384;
+
+struct PixelBuffer
+{
+    int width;
+    int height;
+    int components;
+    std::vector<unsigned char> pixels;
+
+    PixelBuffer (int w, int h, int c)
+        : width (w), height (h), components (c), pixels (w * h * c, 0)
+    {}
+
+    unsigned char * at (int x, int y)
+    {
+        return & pixels[((y * width) + x) * components];
+    }
+
+    const unsigned char * at (int x, int y) const
+    {
+        return & pixels[((y * width) + x) * components];
+    }
+};
+
+// Only plain 8-bit 2D images are preprocessed, anything else is left to GL
+
+bool can_preprocess_image (osg::Image * image)
+{
+    if ((image->getDataType () != GL_UNSIGNED_BYTE) || (image->r () != 1))
+        return false;
+    GLenum format = image->getPixelFormat ();
+    return (format == GL_RGB) || (format == GL_RGBA) ||
+        (format == GL_LUMINANCE) || (format == GL_LUMINANCE_ALPHA) ||
+        (format == GL_ALPHA);
+}
+
+PixelBuffer image_to_pixels (osg::Image * image)
+{
+    int components = osg::Image::computeNumComponents (image->getPixelFormat ());
+    PixelBuffer buffer (image->s (), image->t (), components);
+    size_t row_length = image->s () * components;
+    for (int y = 0; y < image->t (); y++)
+        std::memcpy (buffer.at (0, y), image->data (0, y), row_length);
+    return buffer;
+}
+
+// Average 2x2 blocks, clamping at the edges of odd sized images
+
+PixelBuffer halve_pixels (const PixelBuffer & from)
+{
+    PixelBuffer to (std::max (from.width / 2, 1), std::max (from.height / 2, 1),
+                    from.components);
+    for (int y = 0; y < to.height; y++)
+    {
+        int y0 = std::min (y * 2, from.height - 1);
+        int y1 = std::min ((y * 2) + 1, from.height - 1);
+        for (int x = 0; x < to.width; x++)
+        {
+            int x0 = std::min (x * 2, from.width - 1);
+            int x1 = std::min ((x * 2) + 1, from.width - 1);
+            for (int c = 0; c < from.components; c++)
+            {
+                int sum = from.at (x0, y0)[c] + from.at (x1, y0)[c] +
+                    from.at (x0, y1)[c] + from.at (x1, y1)[c];
+                to.at (x, y)[c] = (unsigned char) ((sum + 2) / 4);
+            }
+        }
+    }
+    return to;
+}
+
+// Box filter down to within a factor of two, then bilinear to the exact size
+
+PixelBuffer resample_pixels (const PixelBuffer & original, int width,
+                             int height)
+{
+    PixelBuffer from = original;
+    while ((from.width >= width * 2) && (from.height >= height * 2))
+        from = halve_pixels (from);
+    if ((from.width == width) && (from.height == height))
+        return from;
+
+    PixelBuffer to (width, height, from.components);
+    for (int y = 0; y < height; y++)
+    {
+        double fy = (((y + 0.5) * from.height) / height) - 0.5;
+        fy = std::max (0.0, std::min (fy, from.height - 1.0));
+        int y0 = (int) fy;
+        int y1 = std::min (y0 + 1, from.height - 1);
+        double wy = fy - y0;
+        for (int x = 0; x < width; x++)
+        {
+            double fx = (((x + 0.5) * from.width) / width) - 0.5;
+            fx = std::max (0.0, std::min (fx, from.width - 1.0));
+            int x0 = (int) fx;
+            int x1 = std::min (x0 + 1, from.width - 1);
+            double wx = fx - x0;
+            for (int c = 0; c < from.components; c++)
+            {
+                double top = (from.at (x0, y0)[c] * (1.0 - wx)) +
+                    (from.at (x1, y0)[c] * wx);
+                double bottom = (from.at (x0, y1)[c] * (1.0 - wx)) +
+                    (from.at (x1, y1)[c] * wx);
+                to.at (x, y)[c] =
+                    (unsigned char) ((top * (1.0 - wy)) + (bottom * wy) + 0.5);
+            }
+        }
+    }
+    return to;
+}
+
+// OSG would resize non-power-of-two textures at upload time, discarding our
+// mipmaps, so pick the nearest power of two now, within max_texture_size.
+
+int texture_dimension (int size)
+{
+    int dimension = 1;
+    while ((dimension * 2) <= size)
+        dimension *= 2;
+    if ((dimension < size) && ((size - dimension) > ((dimension * 2) - size)))
+        dimension *= 2;
+    if (max_texture_size > 0)
+    {
+        while (dimension > max_texture_size && dimension > 1)
+            dimension /= 2;
+    }
+    return dimension;
+}
+
+// Build an image holding the full mip chain, in the layout osg::Image wants:
+// one allocation with level 0 first and the offsets of the others alongside.
+
+osg::Image * mipmapped_image (const std::vector<PixelBuffer> & levels,
+                              GLint internal_format, GLenum pixel_format)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < levels.size (); i++)
+        total += levels[i].pixels.size ();
+    unsigned char * data = new unsigned char[total];
+    osg::Image::MipmapDataType offsets;
+    size_t offset = 0;
+    for (size_t i = 0; i < levels.size (); i++)
+    {
+        if (i > 0)
+            offsets.push_back (offset);
+        std::memcpy (data + offset, & levels[i].pixels[0],
+                     levels[i].pixels.size ());
+        offset += levels[i].pixels.size ();
+    }
+    osg::Image * image = new osg::Image;
+    image->setImage (levels[0].width, levels[0].height, 1, internal_format,
+                     pixel_format, GL_UNSIGNED_BYTE, data,
+                     osg::Image::USE_NEW_DELETE, 1);
+    image->setMipmapLevels (offsets);
+    return image;
+}
+
+std::vector<PixelBuffer> build_mip_chain (osg::Image * image)
+{
+    std::vector<PixelBuffer> levels;
+    levels.push_back (resample_pixels (image_to_pixels (image),
+                                       texture_dimension (image->s ()),
+                                       texture_dimension (image->t ())));
+    while ((levels.back ().width > 1) || (levels.back ().height > 1))
+        levels.push_back (halve_pixels (levels.back ()));
+    return levels;
+}
+
+bool write_uint32 (FILE * file, uint32_t value)
+{
+    return std::fwrite (& value, sizeof (value), 1, file) == 1;
+}
+
+bool read_uint32 (FILE * file, uint32_t & value)
+{
+    return std::fread (& value, sizeof (value), 1, file) == 1;
+}
+
+// Write to a temporary file and rename so concurrent runs never see half a file
+
+bool write_texture_cache (const std::string & path,
+                          const std::vector<PixelBuffer> & levels,
+                          GLint internal_format, GLenum pixel_format)
+{
+    char suffix[32];
+    std::snprintf (suffix, sizeof (suffix), ".%ld.tmp", (long) getpid ());
+    std::string temporary = path + suffix;
+    FILE * file = std::fopen (temporary.c_str (), "wb");
+    if (file == NULL)
+        return false;
+    bool ok = std::fwrite (TEXTURE_CACHE_MAGIC, sizeof (TEXTURE_CACHE_MAGIC),
+                           1, file) == 1;
+    ok = ok && write_uint32 (file, TEXTURE_CACHE_ENDIANNESS);
+    ok = ok && write_uint32 (file, levels[0].width);
+    ok = ok && write_uint32 (file, levels[0].height);
+    ok = ok && write_uint32 (file, internal_format);
+    ok = ok && write_uint32 (file, pixel_format);
+    ok = ok && write_uint32 (file, GL_UNSIGNED_BYTE);
+    ok = ok && write_uint32 (file, levels.size ());
+    for (size_t i = 0; ok && (i < levels.size ()); i++)
+    {
+        ok = write_uint32 (file, levels[i].pixels.size ());
+        ok = ok && (std::fwrite (& levels[i].pixels[0], 1,
+                                 levels[i].pixels.size (), file)
+                    == levels[i].pixels.size ());
+    }
+    ok = (std::fclose (file) == 0) && ok;
+    ok = ok && (std::rename (temporary.c_str (), path.c_str ()) == 0);
+    if (! ok)
+        std::remove (temporary.c_str ());
+    return ok;
+}
+
+osg::Image * read_texture_cache (const std::string & path)
+{
+    FILE * file = std::fopen (path.c_str (), "rb");
+    if (file == NULL)
+        return NULL;
+    char magic[sizeof (TEXTURE_CACHE_MAGIC)];
+    uint32_t endianness, width, height, internal_format, pixel_format;
+    uint32_t data_type, level_count;
+    bool ok = (std::fread (magic, sizeof (magic), 1, file) == 1) &&
+        (std::memcmp (magic, TEXTURE_CACHE_MAGIC, sizeof (magic)) == 0) &&
+        read_uint32 (file, endianness) &&
+        (endianness == TEXTURE_CACHE_ENDIANNESS) &&
+        read_uint32 (file, width) && read_uint32 (file, height) &&
+        read_uint32 (file, internal_format) &&
+        read_uint32 (file, pixel_format) &&
+        read_uint32 (file, data_type) && (data_type == GL_UNSIGNED_BYTE) &&
+        read_uint32 (file, level_count) &&
+        (width > 0) && (width <= MAX_TEXTURE_CACHE_DIMENSION) &&
+        (height > 0) && (height <= MAX_TEXTURE_CACHE_DIMENSION);
+    // A damaged file mustn't stop us falling back to the original image
+    int components = 0;
+    if (ok)
+    {
+        components = osg::Image::computeNumComponents (pixel_format);
+        uint32_t largest = std::max (width, height);
+        uint32_t max_levels = 1;
+        while ((largest >>= 1) > 0)
+            max_levels++;
+        ok = (components > 0) && (components <= 4) &&
+            (level_count > 0) && (level_count <= max_levels);
+    }
+    std::vector<PixelBuffer> levels;
+    int level_width = width;
+    int level_height = height;
+    for (uint32_t i = 0; ok && (i < level_count); i++)
+    {
+        levels.push_back (PixelBuffer (level_width, level_height, components));
+        uint32_t size;
+        ok = read_uint32 (file, size) &&
+            (size == levels.back ().pixels.size ()) &&
+            (std::fread (& levels.back ().pixels[0], 1, size, file) == size);
+        level_width = std::max (level_width / 2, 1);
+        level_height = std::max (level_height / 2, 1);
+    }
+    std::fclose (file);
+    if (! ok)
+        return NULL;
+    return mipmapped_image (levels, internal_format, pixel_format);
+}
+
+// Returns the camouflage image with its mip chain, from the cache if possible
+
+osg::Image * preprocessed_camouflage_image (const std::string & filename)
+{
+    std::string directory = texture_cache_directory;
+    if (directory == "")
+        directory = default_cache_directory ("textures");
+
+    std::string cache_path = "";
+    std::string contents;
+    if (cache_textures && (directory != "") &&
+        read_file_contents (filename, contents))
+    {
+        uint64_t key = hash_string (contents);
+        key = hash_bytes ((const char *) & max_texture_size,
+                          sizeof (max_texture_size), key);
+        cache_path = directory + "/" + hash_to_string (key) + ".sstex";
+        osg::Image * cached = read_texture_cache (cache_path);
+        if (cached != NULL)
+        {
+            if (debug)
+                std::fprintf (stderr, "Camouflage from texture cache %s.\n",
+                              cache_path.c_str ());
+            cached->setFileName (filename);
+            return cached;
+        }
+    }
+
+    osg::ref_ptr<osg::Image> image = osgDB::readImageFile (filename);
+    if ((! image.valid ()) || (! can_preprocess_image (image.get ())))
+        return image.release ();
+
+    std::vector<PixelBuffer> levels = build_mip_chain (image.get ());
+    GLint internal_format = image->getInternalTextureFormat ();
+    GLenum pixel_format = image->getPixelFormat ();
+    osg::Image * mipmapped = mipmapped_image (levels, internal_format,
+                                              pixel_format);
+    mipmapped->setFileName (filename);
+
+    if (cache_path != "")
+    {
+        osgDB::makeDirectory (directory);
+        if (! write_texture_cache (cache_path, levels, internal_format,
+                                   pixel_format))
+            std::fprintf (stderr, "Couldn't write texture cache %s\n",
+                          cache_path.c_str ());
+        else if (debug)
+            std::fprintf (stderr, "Wrote texture cache %s.\n",
+                          cache_path.c_str ());
+    }
+    return mipmapped;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Sharding
+// Every shard executes the whole program, so delivery numbers and positions
+// are the same in each, and keeps just the deliveries assigned to it.
+// Deliveries are named by number so surgical_strike_merge can put the
+// partial scenes back together in program order.
+////////////////////////////////////////////////////////////////////////////////
+
+bool sharding ()
+{
+    return shard_count > 1;
+}
+
+// Round robin by delivery number, or by grid cell of the delivery's position
+// so that neighbouring deliveries end up in the same shard.
+
+bool delivery_in_shard (unsigned long index, const osg::Vec3d & position)
+{
+    if (! sharding ())
+        return true;
+    if (shard_partition == SHARD_BY_INDEX)
+        return (index % shard_count) == (unsigned long) shard_index;
+    int64_t cell[3];
+    for (int i = 0; i < 3; i++)
+        cell[i] = (int64_t) std::floor (position[i] / shard_cell_size);
+    uint64_t hash = hash_bytes ((const char *) cell, sizeof (cell));
+    return (hash % shard_count) == (uint64_t) shard_index;
+}
+
+std::string delivery_name (unsigned long index)
+{
+    char buffer[32];
+    std::snprintf (buffer, sizeof (buffer), "delivery-%lu", index);
+    return buffer;
+}
+
+// Parses i/N
+
+void set_shard (const char * shard)
+{
+    int index, count;
+    char end;
+    if ((std::sscanf (shard, "%d/%d%c", &index, &count, &end) != 2) ||
+        (count < 1) || (index < 0) || (index >= count))
+    {
+        std::fprintf (stderr, "Bad shard %s, should be i/N with 0 <= i < N.\n",
+                      shard);
+        exit (1);
+    }
+    shard_index = index;
+    shard_count = count;
+}
+
+void set_shard_partition (const char * partition)
+{
+    if (std::strcmp (partition, "index") == 0)
+        shard_partition = SHARD_BY_INDEX;
+    else if (std::strcmp (partition, "space") == 0)
+        shard_partition = SHARD_BY_SPACE;
+    else
+    {
+        std::fprintf (stderr, "Bad shard partition %s, should be index or "
+                      "space.\n", partition);
+        exit (1);
+    }
+}
+
+// out.obj becomes out.shard-1-of-4.obj
+
+std::string shard_file_name (const std::string & filename)
+{
+    if (! sharding ())
+        return filename;
+    char buffer[64];
+    std::snprintf (buffer, sizeof (buffer), ".shard-%i-of-%i.",
+                   shard_index, shard_count);
+    return osgDB::getNameLessExtension (filename) + buffer +
+        osgDB::getFileExtension (filename);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Resource budgets
+// Deliveries and codeword depth are checked as they happen. Time and memory
+// cost a system call to check, so they are only checked every few thousand
+// commands.
+////////////////////////////////////////////////////////////////////////////////
+
+struct CodewordCall
+{
+    const std::string * codeword;
+    int repetition;
+    int times;
+
+    CodewordCall (const std::string & word, int count)
+        : codeword (& word), repetition (0), times (count)
+    {}
+};
+
+// The codewords currently executing, outermost first
+std::vector<CodewordCall> codeword_calls;
+
+const unsigned long BUDGET_CHECK_INTERVAL = 4096;
+
+unsigned long commands_since_budget_check = 0;
+
+// Set when execution starts
+osg::Timer_t start_tick = 0;
+
+// Defined below, used to write what we have if we abort
+void deliver_deferred ();
+
+unsigned long resident_memory_mb ()
+{
+#ifdef __linux__
+    FILE * statm = std::fopen ("/proc/self/statm", "r");
+    if (statm != NULL)
+    {
+        unsigned long size, resident;
+        int count = std::fscanf (statm, "%lu %lu", &size, &resident);
+        std::fclose (statm);
+        if (count == 2)
+            return (resident * sysconf (_SC_PAGESIZE)) / (1024 * 1024);
+    }
+#endif
+    // Otherwise the peak, which is in bytes on Mac OS X and kilobytes elsewhere
+    struct rusage usage;
+    if (getrusage (RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024 * 1024);
+#else
+    return usage.ru_maxrss / 1024;
+#endif
+}
+
+// Deferred deliveries are built before writing a partial scene, unless we
+// ran out of time or memory, as building them would only use more of both
+
+void over_budget (const std::string & reason, bool out_of_resources)
+{
+    static bool aborting = false;
+    if (aborting)
+        return;
+    aborting = true;
+
+    std::fprintf (stderr, "Aborting: %s.\n", reason.c_str ());
+    std::fprintf (stderr, "Codeword call stack, innermost first:\n");
+    for (size_t i = codeword_calls.size (); i > 0; i--)
+    {
+        const CodewordCall & call = codeword_calls[i - 1];
+        std::fprintf (stderr, "    %s (repetition %i of %i)\n",
+                      call.codeword->c_str (), call.repetition + 1,
+                      call.times);
+    }
+    std::fprintf (stderr, "%lu deliveries made.\n", delivery_count);
+
+    if (write_partial_scene && (theater != NULL) && (output_file_name != ""))
+    {
+        // If we were part way through building them, the rest are lost
+        if (defer_deliveries && (! delivering_deferred))
+        {
+            if (out_of_resources)
+                std::fprintf (stderr, "Not building deferred deliveries.\n");
+            else
+                deliver_deferred ();
+        }
+        std::fprintf (stderr, "Writing partial scene.\n");
+        write_file (shard_file_name (output_file_name));
+    }
+    exit (2);
+}
+
+void check_delivery_budget ()
+{
+    if ((max_deliveries > 0) && (delivery_count >= max_deliveries))
+    {
+        char reason[64];
+        std::snprintf (reason, sizeof (reason), "more than %lu deliveries",
+                       max_deliveries);
+        over_budget (reason, false);
+    }
+}
+
+void check_codeword_depth_budget ()
+{
+    if ((max_codeword_depth > 0) &&
+        (codeword_calls.size () > max_codeword_depth))
+    {
+        char reason[128];
+        std::snprintf (reason, sizeof (reason), "codewords nested more than "
+                       "%lu deep, does a codeword execute itself?",
+                       max_codeword_depth);
+        over_budget (reason, false);
+    }
+}
+
+void check_time_and_memory_budgets ()
+{
+    if (max_seconds > 0.0)
+    {
+        double elapsed = osg::Timer::instance ()->delta_s
+            (start_tick, osg::Timer::instance ()->tick ());
+        if (elapsed > max_seconds)
+        {
+            char reason[64];
+            std::snprintf (reason, sizeof (reason), "ran for more than %g "
+                           "seconds", max_seconds);
+            over_budget (reason, true);
+        }
+    }
+    if (max_memory_mb > 0)
+    {
+        unsigned long resident = resident_memory_mb ();
+        if (resident > max_memory_mb)
+        {
+            char reason[64];
+            std::snprintf (reason, sizeof (reason), "using %lu MB of memory, "
+                           "more than %lu MB", resident, max_memory_mb);
+            over_budget (reason, true);
+        }
+    }
+}
+
+// Call once per command (or per delivery when building deferred deliveries)
+
+inline void check_budgets ()
+{
+    if (++commands_since_budget_check >= BUDGET_CHECK_INTERVAL)
+    {
+        commands_since_budget_check = 0;
+        check_time_and_memory_budgets ();
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Compressed output
+// Writing to a .ssc file stores each payload's geometry once, quantized and
+// compressed by surgical_strike_codec, and each delivery as a reference to
+// it, so we note deliveries as they are made. surgical_strike_decode reads
+// the file back.
+////////////////////////////////////////////////////////////////////////////////
+
+CodecScene compressed_scene;
+std::vector<osg::Node *> compressed_payloads;
+std::map<osg::Node *, uint32_t> compressed_payload_ids;
+std::map<osg::Texture2D *, uint32_t> compressed_camouflage_ids;
+// Set once the output file name is known
+bool compressing_output = false;
+
+bool is_compressed_file (const std::string & filename)
+{
+    return osgDB::getLowerCaseFileExtension (filename) == "ssc";
+}
+
+void record_compressed_delivery (osg::Node * payload,
+                                 osg::Texture2D * camouflage,
+                                 const osg::Matrixd & transform)
+{
+    CodecInstance instance;
+
+    std::map<osg::Node *, uint32_t>::iterator payload_id =
+        compressed_payload_ids.find (payload);
+    if (payload_id != compressed_payload_ids.end ())
+    {
+        instance.payload = payload_id->second;
+    }
+    else
+    {
+        instance.payload = compressed_payloads.size ();
+        compressed_payloads.push_back (payload);
+        compressed_payload_ids[payload] = instance.payload;
+    }
+
+    instance.camouflage = 0;
+    if (camouflage != NULL)
+    {
+        std::map<osg::Texture2D *, uint32_t>::iterator camouflage_id =
+            compressed_camouflage_ids.find (camouflage);
+        if (camouflage_id != compressed_camouflage_ids.end ())
+        {
+            instance.camouflage = camouflage_id->second;
+        }
+        else
+        {
+            compressed_scene.camouflages.push_back (camouflage->getName ());
+            instance.camouflage = compressed_scene.camouflages.size ();
+            compressed_camouflage_ids[camouflage] = instance.camouflage;
+        }
+    }
+
+    for (int row = 0; row < 3; row++)
+        for (int column = 0; column < 3; column++)
+            instance.rotation[(row * 3) + column] = transform (row, column);
+    for (int column = 0; column < 3; column++)
+        instance.translation[column] = transform (3, column);
+    compressed_scene.instances.push_back (instance);
+}
+
+struct TriangleIndexCollector
+{
+    std::vector<uint32_t> * indices;
+
+    void operator() (unsigned int a, unsigned int b, unsigned int c)
+    {
+        indices->push_back (a);
+        indices->push_back (b);
+        indices->push_back (c);
+    }
+};
+
+// Collects the triangles of each geometry in a payload, in the payload's
+// coordinates. Lines and points are skipped.
+
+struct MeshExtractor : public osg::NodeVisitor
+{
+    uint32_t payload;
+    osg::BoundingSphere bound;
+    std::vector<CodecMesh> & meshes;
+
+    MeshExtractor (uint32_t id, osg::Node * node, std::vector<CodecMesh> & to)
+        : osg::NodeVisitor (osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+          payload (id),
+          bound (node->getBound ()),
+          meshes (to)
+    {}
+
+    void extract (osg::Geometry * geometry, const osg::Matrixd & matrix,
+                  const osg::Matrixd & inverse)
+    {
+        osg::Vec3Array * vertices =
+            dynamic_cast<osg::Vec3Array *> (geometry->getVertexArray ());
+        if ((vertices == NULL) || (vertices->size () == 0))
+            return;
+
+        CodecMesh mesh;
+        mesh.payload = payload;
+        for (int i = 0; i < 3; i++)
+            mesh.center[i] = bound.center ()[i];
+        mesh.radius = bound.radius ();
+
+        osg::TriangleIndexFunctor<TriangleIndexCollector> triangles;
+        triangles.indices = & mesh.indices;
+        geometry->accept (triangles);
+        if (mesh.indices.empty ())
+            return;
+
+        for (unsigned int i = 0; i < vertices->size (); i++)
+        {
+            osg::Vec3d position = osg::Vec3d ((* vertices)[i]) * matrix;
+            for (int j = 0; j < 3; j++)
+                mesh.positions.push_back (position[j]);
+        }
+
+        osg::Vec3Array * normals =
+            dynamic_cast<osg::Vec3Array *> (geometry->getNormalArray ());
+        if ((normals != NULL) &&
+            (normals->getBinding () == osg::Array::BIND_PER_VERTEX) &&
+            (normals->size () == vertices->size ()))
+        {
+            for (unsigned int i = 0; i < normals->size (); i++)
+            {
+                osg::Vec3d normal = osg::Matrixd::transform3x3
+                    (inverse, osg::Vec3d ((* normals)[i]));
+                normal.normalize ();
+                for (int j = 0; j < 3; j++)
+                    mesh.normals.push_back (normal[j]);
+            }
+        }
+
+        osg::Vec2Array * texcoords =
+            dynamic_cast<osg::Vec2Array *> (geometry->getTexCoordArray (0));
+        if ((texcoords != NULL) && (texcoords->size () == vertices->size ()))
+        {
+            for (unsigned int i = 0; i < texcoords->size (); i++)
+            {
+                mesh.texcoords.push_back ((* texcoords)[i].x ());
+                mesh.texcoords.push_back ((* texcoords)[i].y ());
+            }
+        }
+
+        meshes.push_back (mesh);
+    }
+
+    virtual void apply (osg::Geode & geode)
+    {
+        osg::Matrixd matrix = osg::computeLocalToWorld (getNodePath ());
+        osg::Matrixd inverse = osg::Matrixd::inverse (matrix);
+        for (unsigned int i = 0; i < geode.getNumDrawables (); i++)
+        {
+            osg::Geometry * geometry = geode.getDrawable (i)->asGeometry ();
+            if (geometry != NULL)
+                extract (geometry, matrix, inverse);
+        }
+        traverse (geode);
+    }
+};
+
+bool write_compressed_file (const std::string & filename)
 {
-    osg::Vec3d rads(spher.x (),
-                    spher.y () * DEGS_TO_RADS,
-                    spher.z () * DEGS_TO_RADS);
-    return spherical_to_cartesian_radians(rads, scale);
+    compressed_scene.meshes.clear ();
+    for (size_t i = 0; i < compressed_payloads.size (); i++)
+    {
+        MeshExtractor extractor (i, compressed_payloads[i],
+                                 compressed_scene.meshes);
+        compressed_payloads[i]->accept (extractor);
+    }
+    CodecStatistics statistics;
+    bool ok = write_compressed_scene (filename, compressed_scene,
+                                      position_bits, statistics);
+    if (ok)
+        print_codec_statistics ("Encoded", statistics);
+    return ok;
 }
 
+
 ////////////////////////////////////////////////////////////////////////////////
-// Current Transformation Matrix management
+// Delivery
 ////////////////////////////////////////////////////////////////////////////////
 
-osg::Vec3d & origin ()
+void deliver_payload (osg::Node * payload, osg::Texture2D * camouflage,
+                      const osg::Matrixd & transform, unsigned long index)
 {
-    return origin_stack.back ();
-}
+    osg::Node * deliver;
+    deliver = (osg::Node*)payload->clone (osg::CopyOp::SHALLOW_COPY);
 
-osg::Vec3d & position ()
-{
-    return position_stack.back ();
-}
+    if (camouflage != NULL)
+    {
+        //if (debug)
+        //    std::fprintf (stderr, "Camouflaging.\n");
+        osg::ref_ptr<osg::StateSet> stateset = deliver->getOrCreateStateSet ();
+        assert (stateset != NULL);
+        osg::ref_ptr<osg::LightModel> lightModel = new osg::LightModel;
+        lightModel->setTwoSided(true);
+        stateset->setAttributeAndModes(lightModel.get());
+
+        stateset->setTextureAttributeAndModes (0, camouflage,
+                                               osg::StateAttribute::ON
+                                               | osg::StateAttribute::OVERRIDE);
+
+        osg::ref_ptr<osg::TexGen> texGen(new osg::TexGen());
+        const osg::BoundingSphere & bounds = deliver->getBound();
+        float factor = 1.0 / bounds.radius();
+        texGen->setPlane(osg::TexGen::S, osg::Plane(factor, 0.0, 0.0, 0.5));
+        texGen->setPlane(osg::TexGen::T, osg::Plane(0.0, factor, 0.0, 0.5));
+        stateset->setTextureAttributeAndModes(0, texGen);
+    }
+    if (compressing_output)
+        record_compressed_delivery (payload, camouflage, transform);
 
-osg::Vec3d cartesian_position ()
-{
-    double size = payload_sizes[current_payload];
-    return spherical_to_cartesian (position (), size);
-}
+    osg::MatrixTransform * target = new osg::MatrixTransform (transform);
+    if (sharding ())
+        target->setName (delivery_name (index));
 
-osg::Vec3d & rotation ()
-{
-    return rotation_stack.back ();
+    target->addChild (deliver);
+    theater->addChild (target);
 }
 
-osg::Vec3d & scale ()
-{
-    return scale_stack.back ();
-}
 
-osg::Matrixd origin_transform ()
+////////////////////////////////////////////////////////////////////////////////
+// Deferred delivery
+// With --deferred, deliver just records the transformation state in a
+// structure of arrays instance buffer. Once the program has finished
+// executing, the world matrices are computed a block at a time by straight
+// line loops over those arrays that the compiler can vectorize, and the
+// scene is built from them.
+// The matrices match current_transform () to within 1e-12 of the largest
+// value involved (translation, scale or 1.0): both use the same truncated
+// PI, and rotations are rounded to float just as rotation_transform () does.
+////////////////////////////////////////////////////////////////////////////////
+
+struct InstanceBuffer
 {
-    osg::Matrixd matrix;
-    matrix.makeTranslate (origin ());
-    return matrix;
-}
+    // Mark origin
+    std::vector<double> origin_x, origin_y, origin_z;
+    // Spherical position, distance then degrees
+    std::vector<double> distance, longitude, latitude;
+    // Euler rotation in degrees, as float to match rotation_transform ()
+    std::vector<float> roll_x, roll_y, roll_z;
+    std::vector<double> scale_x, scale_y, scale_z;
+    std::vector<double> payload_size;
+    // Indexes into instance_payloads and instance_camouflages
+    std::vector<uint32_t> payload, camouflage;
+    std::vector<unsigned long> number;
+
+    size_t size () const
+    {
+        return number.size ();
+    }
+};
 
-osg::Matrixd origin_transform_from ()
+InstanceBuffer instances;
+
+// The payloads and camouflages referred to by the instance buffer.
+// Camouflage 0 is none.
+std::vector<osg::Node *> instance_payloads;
+std::vector<osg::Texture2D *> instance_camouflages (1, (osg::Texture2D *) NULL);
+std::map<osg::Node *, uint32_t> instance_payload_ids;
+std::map<osg::Texture2D *, uint32_t> instance_camouflage_ids;
+
+uint32_t instance_payload_id (osg::Node * payload)
 {
-    osg::Matrixd matrix;
-    matrix.makeTranslate (origin () + cartesian_position ());
-    return matrix;
+    std::map<osg::Node *, uint32_t>::iterator found =
+        instance_payload_ids.find (payload);
+    if (found != instance_payload_ids.end ())
+        return found->second;
+    uint32_t id = instance_payloads.size ();
+    instance_payloads.push_back (payload);
+    instance_payload_ids[payload] = id;
+    return id;
 }
 
-osg::Matrixd origin_transform_to ()
+uint32_t instance_camouflage_id (osg::Texture2D * camouflage)
 {
-    osg::Matrixd matrix;
-    matrix.makeTranslate (- (origin () + cartesian_position ()));
-    return matrix;
+    if (camouflage == NULL)
+        return 0;
+    std::map<osg::Texture2D *, uint32_t>::iterator found =
+        instance_camouflage_ids.find (camouflage);
+    if (found != instance_camouflage_ids.end ())
+        return found->second;
+    uint32_t id = instance_camouflages.size ();
+    instance_camouflages.push_back (camouflage);
+    instance_camouflage_ids[camouflage] = id;
+    return id;
 }
 
-osg::Matrixd position_transform ()
+void defer_delivery (unsigned long index)
 {
-    osg::Matrixd matrix;
-    matrix.makeTranslate (cartesian_position ());
-    return matrix;
+    // We can't tell which spatial shard a delivery is in until its matrix
+    // has been computed, but we can drop other shards' deliveries by index
+    if (sharding () && (shard_partition == SHARD_BY_INDEX) &&
+        (! delivery_in_shard (index, osg::Vec3d ())))
+        return;
+
+    osg::Vec3f rotate = rotation ();
+    instances.origin_x.push_back (origin ().x ());
+    instances.origin_y.push_back (origin ().y ());
+    instances.origin_z.push_back (origin ().z ());
+    instances.distance.push_back (position ().x ());
+    instances.longitude.push_back (position ().y ());
+    instances.latitude.push_back (position ().z ());
+    instances.roll_x.push_back (rotate.x ());
+    instances.roll_y.push_back (rotate.y ());
+    instances.roll_z.push_back (rotate.z ());
+    instances.scale_x.push_back (scale ().x ());
+    instances.scale_y.push_back (scale ().y ());
+    instances.scale_z.push_back (scale ().z ());
+    instances.payload_size.push_back (payload_sizes[current_payload]);
+    instances.payload.push_back (instance_payload_id (current_payload));
+    instances.camouflage.push_back (instance_camouflage_id (current_camouflage));
+    instances.number.push_back (index);
 }
 
-osg::Matrixd rotation_transform ()
+// sin and cos of count angles in radians, using the Cephes polynomials after
+// Cody-Waite reduction by pi/2. Rounding is done by adding and subtracting
+// 1.5 * 2^52 rather than calling floor (), and the quadrant is chosen with
+// selects rather than branches, so the loop vectorizes with plain SSE2.
+// Accurate to a couple of ulp for |angle| < 2^30.
+
+const double ROUNDER = 6755399441055744.0;
+const double TWO_OVER_PI = 6.36619772367581382433E-1;
+const double PI_OVER_TWO_1 = 1.57079625129699707031E0;
+const double PI_OVER_TWO_2 = 7.54978941586159635336E-8;
+const double PI_OVER_TWO_3 = 5.39030285815811905290E-15;
+
+void sincos_array (const double * angles, double * sines, double * cosines,
+                   size_t count)
 {
-    osg::Vec3f rotate = rotation ();
-    osg::Matrixd matrix = origin_transform_to ();
-    if (rotate.x () != 0.0)
-    {
-        osg::Matrixd rotatex;
-        rotatex.makeRotate (rotate.x () * DEGS_TO_RADS, 1.0, 0, 0);
-        matrix *= rotatex;
-    }
-    if (rotate.y () != 0.0)
-    {
-        osg::Matrixd rotatey;
-        rotatey.makeRotate (rotate.y () * DEGS_TO_RADS, 0.0, 1.0, 0);
-        matrix *= rotatey;
-    }
-    if (rotate.z () != 0.0)
+    for (size_t i = 0; i < count; i++)
     {
-        osg::Matrixd rotatez;
-        rotatez.makeRotate (rotate.z () * DEGS_TO_RADS, 0.0, 0.0, 1.0);
-        matrix  *= rotatez;
+        double x = angles[i];
+        double k = ((x * TWO_OVER_PI) + ROUNDER) - ROUNDER;
+        double r = ((x - (k * PI_OVER_TWO_1)) - (k * PI_OVER_TWO_2))
+            - (k * PI_OVER_TWO_3);
+        double z = r * r;
+        double sine = r + (r * z *
+                           (((((1.58962301576546568060E-10 * z
+                                - 2.50507477628578072866E-8) * z
+                               + 2.75573136213857245213E-6) * z
+                              - 1.98412698295895385996E-4) * z
+                             + 8.33333333332211858878E-3) * z
+                            - 1.66666666666666307295E-1));
+        double cosine = (1.0 - (0.5 * z)) + (z * z *
+                           (((((-1.13585365213876817300E-11 * z
+                                + 2.08757008419747316778E-9) * z
+                               - 2.75573141792967388112E-7) * z
+                              + 2.48015872888517045348E-5) * z
+                             - 1.38888888888730564116E-3) * z
+                            + 4.16666666666665929218E-2));
+        // Quadrant k mod 4, floor (k / 4) being round ((k - 1.5) / 4)
+        double quadrant = k - (4.0 * ((((k - 1.5) * 0.25) + ROUNDER) - ROUNDER));
+        bool odd = (quadrant == 1.0) || (quadrant == 3.0);
+        double s = odd ? cosine : sine;
+        double c = odd ? sine : cosine;
+        sines[i] = (quadrant >= 2.0) ? -s : s;
+        cosines[i] = ((quadrant == 1.0) || (quadrant == 2.0)) ? -c : c;
     }
+}
 
-    matrix *= origin_transform_from ();
+const size_t INSTANCE_BLOCK = 1024;
 
-    return matrix;
-}
+// The affine part of the world matrices for a block of instances,
+// matrix[element][instance] with elements in osg::Matrixd row order:
+// 0-2 the three rows of scale * rotation and 3 the translation.
 
-osg::Matrixd scale_transform ()
+struct InstanceMatrices
 {
-    osg::Matrixd matrix;// = origin_transform_to ();
+    double rows[4][3][INSTANCE_BLOCK];
+};
 
-    osg::Matrixd scaling;
-    scaling.makeScale (scale ());
-    matrix *= scaling;
-    
-    //matrix *= origin_transform_from ();
-    return matrix;
-}
+// current_transform () is
+//   T(origin) T(cartesian) S(scale) T(-p) Rx Ry Rz T(p)
+// where p = origin + cartesian, acting on row vectors. That collapses to
+//   v' = v (S R) + (p S - p) R + p
+// with R = Rx Ry Rz, which is what we compute here.
 
-osg::Matrixd current_transform ()
+void compute_instance_matrices (size_t begin, size_t count,
+                                InstanceMatrices & matrices)
 {
-    return origin_transform () *
-        position_transform () *
-        scale_transform () *
-        rotation_transform () ;
-}
+    assert (count <= INSTANCE_BLOCK);
+    double angles[5][INSTANCE_BLOCK];
+    double sines[5][INSTANCE_BLOCK];
+    double cosines[5][INSTANCE_BLOCK];
+    for (size_t i = 0; i < count; i++)
+    {
+        angles[0][i] = instances.longitude[begin + i] * DEGS_TO_RADS;
+        angles[1][i] = instances.latitude[begin + i] * DEGS_TO_RADS;
+        angles[2][i] = instances.roll_x[begin + i] * DEGS_TO_RADS;
+        angles[3][i] = instances.roll_y[begin + i] * DEGS_TO_RADS;
+        angles[4][i] = instances.roll_z[begin + i] * DEGS_TO_RADS;
+    }
+    for (int a = 0; a < 5; a++)
+        sincos_array (angles[a], sines[a], cosines[a], count);
 
-void push_transforms ()
-{
-    osg::Vec3d zero (0.0, 0.0, 0.0);
-    // FIXME: If you mark after loading a new model of a different size
-    // this will set the origin based on the new size.
-    // For the moment just make sure to load inside marks.
-    origin_stack.push_back (cartesian_position ());
-    position_stack.push_back (zero);
-    rotation_stack.push_back (rotation ());
-    scale_stack.push_back (scale ());
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t n = begin + i;
+        double sl = sines[0][i], cl = cosines[0][i];
+        double sp = sines[1][i], cp = cosines[1][i];
+        double sx = sines[2][i], cx = cosines[2][i];
+        double sy = sines[3][i], cy = cosines[3][i];
+        double sz = sines[4][i], cz = cosines[4][i];
+
+        double radius = instances.payload_size[n] * instances.distance[n];
+        double px = instances.origin_x[n] + (radius * cp * cl);
+        double py = instances.origin_y[n] + (radius * cp * sl);
+        double pz = instances.origin_z[n] + (radius * sp);
+
+        double r00 = cy * cz;
+        double r01 = cy * sz;
+        double r02 = -sy;
+        double r10 = (sx * sy * cz) - (cx * sz);
+        double r11 = (sx * sy * sz) + (cx * cz);
+        double r12 = sx * cy;
+        double r20 = (cx * sy * cz) + (sx * sz);
+        double r21 = (cx * sy * sz) - (sx * cz);
+        double r22 = cx * cy;
+
+        double kx = instances.scale_x[n];
+        double ky = instances.scale_y[n];
+        double kz = instances.scale_z[n];
+        matrices.rows[0][0][i] = kx * r00;
+        matrices.rows[0][1][i] = kx * r01;
+        matrices.rows[0][2][i] = kx * r02;
+        matrices.rows[1][0][i] = ky * r10;
+        matrices.rows[1][1][i] = ky * r11;
+        matrices.rows[1][2][i] = ky * r12;
+        matrices.rows[2][0][i] = kz * r20;
+        matrices.rows[2][1][i] = kz * r21;
+        matrices.rows[2][2][i] = kz * r22;
+
+        double dx = px * (kx - 1.0);
+        double dy = py * (ky - 1.0);
+        double dz = pz * (kz - 1.0);
+        matrices.rows[3][0][i] = (dx * r00) + (dy * r10) + (dz * r20) + px;
+        matrices.rows[3][1][i] = (dx * r01) + (dy * r11) + (dz * r21) + py;
+        matrices.rows[3][2][i] = (dx * r02) + (dy * r12) + (dz * r22) + pz;
+    }
 }
 
-void pop_transforms ()
+osg::Matrixd instance_matrix (const InstanceMatrices & matrices, size_t i)
 {
-    origin_stack.pop_back ();
-    position_stack.pop_back ();
-    rotation_stack.pop_back ();
-    scale_stack.pop_back ();
-
-    //TODO: Issue helpful warning message
-    assert (! origin_stack.empty ());
+    return osg::Matrixd (matrices.rows[0][0][i], matrices.rows[0][1][i],
+                         matrices.rows[0][2][i], 0.0,
+                         matrices.rows[1][0][i], matrices.rows[1][1][i],
+                         matrices.rows[1][2][i], 0.0,
+                         matrices.rows[2][0][i], matrices.rows[2][1][i],
+                         matrices.rows[2][2][i], 0.0,
+                         matrices.rows[3][0][i], matrices.rows[3][1][i],
+                         matrices.rows[3][2][i], 1.0);
 }
 
-void initialize_transforms ()
+// Build the scene from the instance buffer, then empty it
+
+void deliver_deferred ()
 {
-    osg::Vec3d zero (0.0, 0.0, 0.0);
-    origin_stack.push_back (zero);
-    position_stack.push_back (zero);
-    rotation_stack.push_back (zero);
-    osg::Vec3d one (1.0, 1.0, 1.0);
-    scale_stack.push_back (one);
+    if (debug)
+        std::fprintf (stderr, "Delivering %lu deferred payloads\n",
+                      (unsigned long) instances.size ());
+    delivering_deferred = true;
+    InstanceMatrices * matrices = new InstanceMatrices;
+    for (size_t begin = 0; begin < instances.size (); begin += INSTANCE_BLOCK)
+    {
+        size_t count = std::min (INSTANCE_BLOCK, instances.size () - begin);
+        compute_instance_matrices (begin, count, * matrices);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t n = begin + i;
+            check_budgets ();
+            osg::Matrixd transform = instance_matrix (* matrices, i);
+            if (! delivery_in_shard (instances.number[n],
+                                     transform.getTrans ()))
+                continue;
+            deliver_payload (instance_payloads[instances.payload[n]],
+                             instance_camouflages[instances.camouflage[n]],
+                             transform, instances.number[n]);
+        }
+    }
+    delete matrices;
+    instances = InstanceBuffer ();
+    delivering_deferred = false;
 }
 
 
@@ -411,18 +1733,6 @@ struct Clear : public Command
     }
 };
 
-bool file_exists (const std::string filename)
-{
-    bool exists = false;
-    int fd = open (filename.c_str (), O_RDONLY);
-    if (fd != -1)
-    {
-        close (fd);
-        exists = true;
-    }
-    return exists;
-}
-
 struct Camouflage : public Command
 {
     std::string camouflage_file_name;
@@ -442,6 +1752,12 @@ struct Camouflage : public Command
         texture->setFilter (osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
         texture->setWrap (osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
         texture->setWrap (osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+        // Preprocessed images carry their own mip chain
+        if (image->isMipmap ())
+        {
+            texture->setUseHardwareMipMapGeneration (false);
+            texture->setResizeNonPowerOfTwoHint (false);
+        }
         texture->setImage (image);
         return texture;
     }
@@ -471,9 +1787,17 @@ struct Camouflage : public Command
             }
 
             osg::Image * image_from_file =
-                osgDB::readImageFile (camouflage_file_name);
+                preprocessed_camouflage_image (camouflage_file_name);
+            if (image_from_file == NULL)
+            {
+                std::fprintf (stderr, "Couldn't load camouflage %s. Line %i.\n",
+                              camouflage_file_name.c_str (), yylineno);
+                exit (1);
+            }
             osg::Texture2D * camouflage_from_file =
                 imageToTexture(image_from_file);
+            // Named so partial scenes can be matched up when merging
+            camouflage_from_file->setName (camouflage_file_name);
             camouflages [camouflage_file_name] = camouflage_from_file;
             current_camouflage = camouflage_from_file;
             if (debug)
@@ -536,6 +1860,8 @@ struct Payload : public Command
                 exit (1);
 
             }
+            if (optimize_payloads)
+                optimize_payload (payload_read);
             payloads [payload_file_name] = payload_read;
             payload_sizes [payload_read] = payload_read->getBound().radius();
             current_payload = payload_read;
@@ -558,35 +1884,18 @@ struct Deliver : public Command
         if (debug)
             std::fprintf (stderr, "Delivering payload\n");
 
-        osg::Node * deliver;
-        deliver = (osg::Node*)current_payload->clone (osg::CopyOp::SHALLOW_COPY);
-
-        if (current_camouflage != NULL)
+        check_delivery_budget ();
+        unsigned long index = delivery_count++;
+        if (defer_deliveries)
         {
-            //if (debug)
-            //    std::fprintf (stderr, "Camouflaging.\n");
-            osg::ref_ptr<osg::StateSet> stateset = deliver->getOrCreateStateSet ();
-            assert (stateset != NULL);
-            osg::ref_ptr<osg::LightModel> lightModel = new osg::LightModel;
-            lightModel->setTwoSided(true);
-            stateset->setAttributeAndModes(lightModel.get());
-            
-            stateset->setTextureAttributeAndModes (0, current_camouflage,
-                                                   osg::StateAttribute::ON
-                                                   | osg::StateAttribute::OVERRIDE);
-            
-            osg::ref_ptr<osg::TexGen> texGen(new osg::TexGen());
-            const osg::BoundingSphere & bounds = deliver->getBound();
-            float factor = 1.0 / bounds.radius();
-            texGen->setPlane(osg::TexGen::S, osg::Plane(factor, 0.0, 0.0, 0.5));
-            texGen->setPlane(osg::TexGen::T, osg::Plane(0.0, factor, 0.0, 0.5));
-            stateset->setTextureAttributeAndModes(0, texGen);
+            defer_delivery (index);
+            return;
         }
-        osg::MatrixTransform * target =
-            new osg::MatrixTransform (current_transform ());
 
-        target->addChild (deliver);
-        theater->addChild (target);
+        osg::Matrixd transform = current_transform ();
+        if (! delivery_in_shard (index, transform.getTrans ()))
+            return;
+        deliver_payload (current_payload, current_camouflage, transform, index);
     }
 };
 
@@ -620,20 +1929,313 @@ struct CodewordExecution : public Command
           codewords [word] = codeword;
           push_target (codeword); */
 
-        std::vector<Command *> commands = codewords[codeword];
+        codeword_calls.push_back (CodewordCall (codeword, times));
+        check_codeword_depth_budget ();
+
+        const std::vector<Command *> & commands = codewords[codeword];
         for (int i = 0; i < times; i++)
         {
+            codeword_calls.back ().repetition = i;
             for (size_t j = 0; j < commands.size (); j++)
             {
+                check_budgets ();
                 commands[j]->execute ();
             }
         }
 
+        codeword_calls.pop_back ();
         //pop_target ();
     }
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Result cache
+// The output depends only on the program, the payloads and camouflages it
+// loads, the output file's name and format, the options that change what
+// is delivered, and this version of the code. If we have written a file
+// for the same hash of all of those before, we link or copy it into place
+// rather than executing the program.
+// Each result is a directory named after the hash, holding the output file
+// and any files written alongside it. Directories are touched when used and
+// the least recently used are evicted when the cache grows too large.
+// Files that payloads load themselves, such as an obj's textures, are not
+// part of the hash.
+////////////////////////////////////////////////////////////////////////////////
+
+// The output file and the files the writer puts next to it
+
+std::vector<std::string> output_files (const std::string & filename)
+{
+    std::vector<std::string> files;
+    files.push_back (filename);
+    if (osgDB::getLowerCaseFileExtension (filename) == "obj")
+        files.push_back (osgDB::getNameLessExtension (filename) + ".mtl");
+    return files;
+}
+
+// The files loaded by load and camouflage commands, in program order
+
+std::vector<std::string> program_assets ()
+{
+    std::vector<std::string> assets;
+    std::map <std::string, std::vector <Command*> >::iterator codeword;
+    for (codeword = codewords.begin (); codeword != codewords.end ();
+         codeword++)
+    {
+        for (size_t i = 0; i < codeword->second.size (); i++)
+        {
+            Command * command = codeword->second[i];
+            if (Payload * payload = dynamic_cast<Payload *> (command))
+                assets.push_back (payload->payload_file_name);
+            else if (Camouflage * camouflage =
+                     dynamic_cast<Camouflage *> (command))
+                assets.push_back (camouflage->camouflage_file_name);
+        }
+    }
+    return assets;
+}
+
+// Different builds of us or of OpenSceneGraph can write different output
+// for the same program, and VERSION rarely changes, so key on the
+// executable's contents where we can read them, or else when it was built
+
+uint64_t hash_build (uint64_t key)
+{
+    key = hash_string (VERSION, key);
+    key = hash_string (osgGetVersion (), key);
+#ifdef __linux__
+    std::string executable;
+    if (read_file_contents ("/proc/self/exe", executable))
+        return hash_string (executable, key);
+#endif
+    return hash_string (__DATE__ " " __TIME__, key);
+}
+
+std::string result_cache_key (const std::string & savefilename)
+{
+    char options[256];
+    std::snprintf (options, sizeof (options),
+                   "optimize %i max texture size %i shard %i/%i by %i "
+                   "cell %.17g deferred %i position bits %i",
+                   (int) optimize_payloads, max_texture_size,
+                   shard_index, shard_count,
+                   (int) shard_partition, shard_cell_size,
+                   (int) defer_deliveries, position_bits);
+
+    uint64_t key = hash_build (HASH_SEED);
+    key = hash_string (osgDB::getSimpleFileName (savefilename), key);
+    key = hash_string (options, key);
+    key = hash_string (program_text, key);
+
+    std::vector<std::string> assets = program_assets ();
+    for (size_t i = 0; i < assets.size (); i++)
+    {
+        std::string contents;
+        key = hash_string (assets[i], key);
+        if (read_file_contents (assets[i], contents))
+            key = hash_string (contents, key);
+        else
+            key = hash_string ("missing", key);
+    }
+    return hash_to_string (key);
+}
+
+std::string result_cache_root ()
+{
+    if (result_cache_directory != "")
+        return result_cache_directory;
+    return default_cache_directory ("results");
+}
+
+bool copy_file_contents (const std::string & from, const std::string & to)
+{
+    int in = open (from.c_str (), O_RDONLY);
+    if (in == -1)
+        return false;
+    int out = open (to.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+    {
+        close (in);
+        return false;
+    }
+    bool ok = true;
+#if defined (__linux__) && defined (FICLONE)
+    // Share the blocks on filesystems that can, such as btrfs and xfs
+    if (ioctl (out, FICLONE, in) == 0)
+    {
+        close (in);
+        return close (out) == 0;
+    }
+#endif
+    char buffer[65536];
+    ssize_t count;
+    while (ok && ((count = read (in, buffer, sizeof (buffer))) > 0))
+        ok = write (out, buffer, count) == count;
+    ok = ok && (count == 0);
+    close (in);
+    ok = (close (out) == 0) && ok;
+    return ok;
+}
+
+// Never hard link, as the merge and decode tools and anything else that
+// rewrites the output in place would write through the link into the cache.
+// Unlink first in case an older run left a link there.
+
+bool restore_file (const std::string & from, const std::string & to)
+{
+    unlink (to.c_str ());
+    return copy_file_contents (from, to);
+}
+
+void remove_directory (const std::string & directory)
+{
+    DIR * dir = opendir (directory.c_str ());
+    if (dir != NULL)
+    {
+        struct dirent * entry;
+        while ((entry = readdir (dir)) != NULL)
+        {
+            std::string name = entry->d_name;
+            if ((name != ".") && (name != ".."))
+                unlink ((directory + "/" + name).c_str ());
+        }
+        closedir (dir);
+    }
+    rmdir (directory.c_str ());
+}
+
+bool restore_cached_result (const std::string & key,
+                            const std::string & savefilename)
+{
+    std::string entry = result_cache_root () + "/" + key;
+    std::vector<std::string> files = output_files (savefilename);
+    for (size_t i = 0; i < files.size (); i++)
+    {
+        std::string cached = entry + "/" + osgDB::getSimpleFileName (files[i]);
+        // Files alongside the output are optional, the output isn't
+        if (! file_exists (cached))
+        {
+            if (i == 0)
+                return false;
+            continue;
+        }
+        if (! restore_file (cached, files[i]))
+        {
+            std::fprintf (stderr, "Couldn't restore %s from result cache.\n",
+                          files[i].c_str ());
+            return false;
+        }
+    }
+    // Mark as recently used
+    utimes (entry.c_str (), NULL);
+    if (debug)
+        std::fprintf (stderr, "Restored %s from result cache %s.\n",
+                      savefilename.c_str (), entry.c_str ());
+    return true;
+}
+
+struct CachedResult
+{
+    std::string path;
+    time_t used;
+    unsigned long long bytes;
+
+    bool operator< (const CachedResult & other) const
+    {
+        return used < other.used;
+    }
+};
+
+void evict_cached_results (const std::string & root)
+{
+    std::vector<CachedResult> results;
+    unsigned long long total = 0;
+    DIR * dir = opendir (root.c_str ());
+    if (dir == NULL)
+        return;
+    struct dirent * entry;
+    while ((entry = readdir (dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        struct stat info;
+        CachedResult result;
+        result.path = root + "/" + name;
+        // Only finished results, which are named by a bare hash
+        if ((name.size () != 16) || (stat (result.path.c_str (), &info) != 0)
+            || (! S_ISDIR (info.st_mode)))
+            continue;
+        result.used = info.st_mtime;
+        result.bytes = 0;
+        DIR * files = opendir (result.path.c_str ());
+        if (files != NULL)
+        {
+            struct dirent * file;
+            while ((file = readdir (files)) != NULL)
+            {
+                std::string path = result.path + "/" + file->d_name;
+                if ((stat (path.c_str (), &info) == 0) && S_ISREG (info.st_mode))
+                    result.bytes += info.st_size;
+            }
+            closedir (files);
+        }
+        total += result.bytes;
+        results.push_back (result);
+    }
+    closedir (dir);
+
+    std::sort (results.begin (), results.end ());
+    unsigned long long limit = result_cache_size_mb * 1024ULL * 1024ULL;
+    for (size_t i = 0; (i < results.size ()) && (total > limit); i++)
+    {
+        if (debug)
+            std::fprintf (stderr, "Evicting %s from result cache.\n",
+                          results[i].path.c_str ());
+        remove_directory (results[i].path);
+        total -= results[i].bytes;
+    }
+}
+
+// Copy into a temporary directory and rename it into place, so other
+// processes never see a partial result
+
+void store_cached_result (const std::string & key,
+                          const std::string & savefilename)
+{
+    std::string root = result_cache_root ();
+    std::string entry = root + "/" + key;
+    char suffix[32];
+    std::snprintf (suffix, sizeof (suffix), ".%ld.tmp", (long) getpid ());
+    std::string temporary = entry + suffix;
+    if (! osgDB::makeDirectory (temporary))
+    {
+        std::fprintf (stderr, "Couldn't create result cache %s\n",
+                      temporary.c_str ());
+        return;
+    }
+    bool ok = true;
+    std::vector<std::string> files = output_files (savefilename);
+    for (size_t i = 0; ok && (i < files.size ()); i++)
+    {
+        if (file_exists (files[i]))
+            ok = copy_file_contents
+                (files[i], temporary + "/" + osgDB::getSimpleFileName (files[i]));
+    }
+    if (ok && (rename (temporary.c_str (), entry.c_str ()) == 0))
+    {
+        if (debug)
+            std::fprintf (stderr, "Stored %s in result cache %s.\n",
+                          savefilename.c_str (), entry.c_str ());
+    }
+    else
+    {
+        // Most likely another process stored the same result first
+        remove_directory (temporary);
+    }
+    evict_cached_results (root);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Parsing
 ////////////////////////////////////////////////////////////////////////////////
@@ -741,7 +2343,16 @@ void parse_codeword_execution (const char * codeword, int times)
 void write_file (const std::string & filename)
 {
     std::fprintf (stderr, "Writing file %s\n", filename.c_str ());
-    bool ok = osgDB::writeNodeFile (*theater, filename);
+    // The old files may be links into the result cache, so don't write
+    // through them
+    std::vector<std::string> files = output_files (filename);
+    for (size_t i = 0; i < files.size (); i++)
+        unlink (files[i].c_str ());
+    bool ok;
+    if (is_compressed_file (filename))
+        ok = write_compressed_file (filename);
+    else
+        ok = osgDB::writeNodeFile (*theater, filename);
     if (! ok)
     {
         std::fprintf (stderr, "Couldn't write file %s\n", filename.c_str ());
@@ -751,13 +2362,52 @@ void write_file (const std::string & filename)
 
 void run_main (const std::string & savefilename)
 {
+    output_file_name = savefilename;
+    compressing_output = is_compressed_file (savefilename);
+    // .ssc files don't keep delivery numbers, so couldn't be merged
+    if (compressing_output && sharding ())
+    {
+        std::fprintf (stderr, "Can't shard .ssc output, as the partial files "
+                      "couldn't be merged.\n");
+        exit (1);
+    }
+    start_tick = osg::Timer::instance ()->tick ();
+
+    std::string filename = shard_file_name (savefilename);
+    std::string cache_key = "";
+    if (cache_results)
+    {
+        cache_key = result_cache_key (filename);
+        if (restore_cached_result (cache_key, filename))
+        {
+            if ((! view_scene) || sharding ())
+                return;
+            osg::ref_ptr<osg::Node> cached = osgDB::readNodeFile (filename);
+            if (! cached.valid ())
+                return;
+            osgViewer::Viewer viewer;
+            viewer.setSceneData (cached.get ());
+            viewer.realize ();
+            viewer.run ();
+            return;
+        }
+    }
+
     CodewordExecution main (MAIN, 1);
     main.execute ();
+    if (defer_deliveries)
+        deliver_deferred ();
 
     if (debug) std::fprintf (stderr, "Writing output file.\n");
-    write_file (savefilename);
+    write_file (filename);
+    if (cache_key != "")
+        store_cached_result (cache_key, filename);
     if (debug) std::fprintf (stderr, "Finished.\n");
 
+    // A shard only has part of the scene, and is usually run in batches
+    if ((! view_scene) || sharding ())
+        return;
+
     osgViewer::Viewer viewer;
     viewer.setSceneData (theater);
     viewer.realize ();
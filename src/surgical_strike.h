@@ -32,6 +32,9 @@ void parse_payload (std::string payload_file_name);
 void parse_deliver ();
 void parse_codeword_execution (const char * codeword, int times);
 
+void set_shard (const char * shard);
+void set_shard_partition (const char * partition);
+
 void write_file (const std::string & filename);
 void run_main (const std::string & savefilename);
 
@@ -19,8 +19,10 @@
 %{
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include "surgical_strike.h"
 
@@ -115,6 +117,103 @@ extern int yylineno;
 extern char * yytext;
 
 extern bool debug;
+extern std::string texture_cache_directory;
+extern bool optimize_payloads;
+extern bool cache_textures;
+extern int max_texture_size;
+extern bool view_scene;
+extern bool defer_deliveries;
+extern unsigned long max_deliveries;
+extern unsigned long max_codeword_depth;
+extern double max_seconds;
+extern unsigned long max_memory_mb;
+extern bool write_partial_scene;
+extern bool cache_results;
+extern std::string result_cache_directory;
+extern unsigned long result_cache_size_mb;
+extern std::string program_text;
+extern int position_bits;
+extern FILE * yyin;
+extern double shard_cell_size;
+
+void usage ()
+{
+  std::printf ("Surgical Strike Free Software version 0.4\n"
+	       "USAGE:\n"
+	       "surgical_strike - Read from stdin, write to out.obj|.mtl\n"
+	       "surgical_strike [options] [input file] [output file] - "
+	       "Read input file, write output file\n"
+	       "OPTIONS:\n"
+	       "--no-optimize-payloads - Use payload meshes as they are "
+	       "loaded\n"
+	       "--texture-cache [directory] - Keep preprocessed camouflage "
+	       "textures here\n"
+	       "  (default ~/.cache/surgical_strike/textures)\n"
+	       "--no-texture-cache - Don't keep preprocessed camouflage "
+	       "textures\n"
+	       "--max-texture-size [pixels] - Downscale larger camouflage "
+	       "images\n"
+	       "--no-view - Don't show the scene after writing it\n"
+	       "--deferred - Record deliveries and build them all after "
+	       "execution\n"
+	       "--max-deliveries [count] - Abort after this many "
+	       "deliveries\n"
+	       "--max-depth [count] - Abort if codewords nest deeper than "
+	       "this (default 1000)\n"
+	       "--max-seconds [seconds] - Abort after running this long\n"
+	       "--max-memory [megabytes] - Abort if using more memory than "
+	       "this\n"
+	       "--write-partial - Write what has been delivered when "
+	       "aborting\n"
+	       "--result-cache - Reuse the output of earlier runs of the "
+	       "same program and assets\n"
+	       "--result-cache-directory [directory] - Keep results here\n"
+	       "  (default ~/.cache/surgical_strike/results)\n"
+	       "--result-cache-size [megabytes] - Evict the least recently "
+	       "used results above this (default 1024)\n"
+	       "--position-bits [bits] - Precision of positions in .ssc "
+	       "output (default 16)\n"
+	       "--shard [i/N] - Keep only deliveries in shard i of N, "
+	       "write [output].shard-i-of-N.[ext]\n"
+	       "--shard-by [index|space] - Assign deliveries to shards by "
+	       "number or position\n"
+	       "--shard-cell-size [size] - Grid cell size when sharding by "
+	       "space\n");
+}
+
+// Returns the argument following an option, or exits if there isn't one
+
+const char * option_value (int argc, char ** argv, int & i)
+{
+  if (i + 1 >= argc)
+  {
+      std::fprintf (stderr, "Missing value for option %s.\n", argv[i]);
+      exit (1);
+  }
+  i++;
+  return argv[i];
+}
+
+// The result cache needs the program text, so read all of it and have the
+// lexer read a copy, as stdin may be a pipe we can't rewind
+
+void read_program_text ()
+{
+  char buffer[65536];
+  size_t count;
+  while ((count = std::fread (buffer, 1, sizeof (buffer), stdin)) > 0)
+      program_text.append (buffer, count);
+  FILE * copy = std::tmpfile ();
+  if ((copy == NULL) ||
+      (std::fwrite (program_text.data (), 1, program_text.size (), copy)
+       != program_text.size ()))
+  {
+      std::fprintf (stderr, "Couldn't copy program text.\n");
+      exit (1);
+  }
+  std::rewind (copy);
+  yyin = copy;
+}
 
 void yyerror (const char *msg)
 {
@@ -125,31 +224,133 @@ void yyerror (const char *msg)
 int main(int argc, char ** argv)
 {
   std::string output_file = "out.obj";
-  if (((argc == 2) &&
-       (std::strcmp (argv[1], "--help") == 0)) ||
-      (argc > 3))
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++)
   {
-      std::printf ("Surgical Strike Free Software version 0.4\n"
-		   "USAGE:\n"
-		   "surgical_strike - Read from stdin, write to out.obj|.mtl\n"
-		   "surgical_strike [input file] [output file] - "
-		   "Read input file, write output file\n");
+      if (std::strcmp (argv[i], "--help") == 0)
+      {
+          usage ();
+          exit (0);
+      }
+      else if (std::strcmp (argv[i], "--no-optimize-payloads") == 0)
+      {
+          optimize_payloads = false;
+      }
+      else if (std::strcmp (argv[i], "--texture-cache") == 0)
+      {
+          texture_cache_directory = option_value (argc, argv, i);
+      }
+      else if (std::strcmp (argv[i], "--no-texture-cache") == 0)
+      {
+          cache_textures = false;
+      }
+      else if (std::strcmp (argv[i], "--max-texture-size") == 0)
+      {
+          max_texture_size = std::atoi (option_value (argc, argv, i));
+      }
+      else if (std::strcmp (argv[i], "--no-view") == 0)
+      {
+          view_scene = false;
+      }
+      else if (std::strcmp (argv[i], "--deferred") == 0)
+      {
+          defer_deliveries = true;
+      }
+      else if (std::strcmp (argv[i], "--max-deliveries") == 0)
+      {
+          max_deliveries = std::strtoul (option_value (argc, argv, i), NULL, 10);
+      }
+      else if (std::strcmp (argv[i], "--max-depth") == 0)
+      {
+          max_codeword_depth = std::strtoul (option_value (argc, argv, i),
+                                             NULL, 10);
+      }
+      else if (std::strcmp (argv[i], "--max-seconds") == 0)
+      {
+          max_seconds = std::atof (option_value (argc, argv, i));
+      }
+      else if (std::strcmp (argv[i], "--max-memory") == 0)
+      {
+          max_memory_mb = std::strtoul (option_value (argc, argv, i), NULL, 10);
+      }
+      else if (std::strcmp (argv[i], "--write-partial") == 0)
+      {
+          write_partial_scene = true;
+      }
+      else if (std::strcmp (argv[i], "--result-cache") == 0)
+      {
+          cache_results = true;
+      }
+      else if (std::strcmp (argv[i], "--result-cache-directory") == 0)
+      {
+          result_cache_directory = option_value (argc, argv, i);
+      }
+      else if (std::strcmp (argv[i], "--result-cache-size") == 0)
+      {
+          result_cache_size_mb = std::strtoul (option_value (argc, argv, i),
+                                               NULL, 10);
+      }
+      else if (std::strcmp (argv[i], "--position-bits") == 0)
+      {
+          position_bits = std::atoi (option_value (argc, argv, i));
+          if ((position_bits < 1) || (position_bits > 24))
+          {
+              std::fprintf (stderr, "Position bits must be from 1 to 24.\n");
+              exit (1);
+          }
+      }
+      else if (std::strcmp (argv[i], "--shard") == 0)
+      {
+          set_shard (option_value (argc, argv, i));
+      }
+      else if (std::strcmp (argv[i], "--shard-by") == 0)
+      {
+          set_shard_partition (option_value (argc, argv, i));
+      }
+      else if (std::strcmp (argv[i], "--shard-cell-size") == 0)
+      {
+          shard_cell_size = std::atof (option_value (argc, argv, i));
+          if (shard_cell_size <= 0.0)
+          {
+              std::fprintf (stderr, "Shard cell size must be positive.\n");
+              exit (1);
+          }
+      }
+      else if (std::strncmp (argv[i], "--", 2) == 0)
+      {
+          std::fprintf (stderr, "Unknown option %s.\n", argv[i]);
+          usage ();
+          exit (1);
+      }
+      else
+      {
+          files.push_back (argv[i]);
+      }
+  }
+  if (files.size () > 2)
+  {
+      usage ();
       exit (0);
   }
   if (debug) std::fprintf (stderr, "Starting up.\n");
-  if (argc == 2)
+  if (files.size () >= 1)
   {
-      std::fprintf (stderr, "Opening input file %s.\n", argv[1]);
-      FILE * new_stdin = freopen (argv[1], "r", stdin);
+      std::fprintf (stderr, "Opening input file %s.\n", files[0].c_str ());
+      FILE * new_stdin = freopen (files[0].c_str (), "r", stdin);
       if (new_stdin == NULL)
       {
-          std::fprintf (stderr, "Couldn't open input file %s.\n", argv[1]);
+          std::fprintf (stderr, "Couldn't open input file %s.\n",
+                        files[0].c_str ());
           exit (1);
       }
   }
-  if (argc == 3)
+  if (files.size () == 2)
+  {
+      output_file = files[1];
+  }
+  if (cache_results)
   {
-      output_file = argv[2];
+      read_program_text ();
   }
   if (debug) std::fprintf (stderr, "Parsing input file.\n");
   yyparse ();
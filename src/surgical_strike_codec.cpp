@@ -0,0 +1,943 @@
+/*
+  Surgical Strike (Free Software Version).
+  Copyright (C) 2008, 2014 Rob Myers
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The file is:
+//   the magic number, then blocks until an end block.
+// Each block is:
+//   type byte, method byte, raw size, stored size (both 32 bit), contents.
+// The contents are stored as they are, or rANS entropy coded with a table
+// of byte frequencies at their start, whichever is smaller.
+// Integers are little endian, or variable length (7 bits per byte, low
+// bits first). Signed values are zigzag coded first.
+// Meshes come before the instances that use them.
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#include <sys/time.h>
+
+#include "surgical_strike_codec.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants
+////////////////////////////////////////////////////////////////////////////////
+
+const char CODEC_MAGIC[8] = {'S', 'S', 'C', 'O', 'M', 'P', '0', '2'};
+
+enum BlockType
+{
+    BLOCK_END = 0,
+    BLOCK_CAMOUFLAGES = 1,
+    BLOCK_MESH = 2,
+    BLOCK_INSTANCES = 3
+};
+
+enum BlockMethod
+{
+    METHOD_STORED = 0,
+    METHOD_RANS = 1
+};
+
+enum MeshFlags
+{
+    MESH_NORMALS = 1,
+    MESH_TEXCOORDS = 2
+};
+
+const int NORMAL_BITS = 12;
+const int TEXCOORD_BITS = 16;
+
+const size_t INSTANCES_PER_BLOCK = 65536;
+
+// An instance's payload and camouflage deltas take 1 to 5 bytes each, then
+// its matrix takes 9 floats and 3 doubles
+const uint64_t MIN_INSTANCE_BYTES = 2 + (9 * 4) + (3 * 8);
+const uint64_t MAX_INSTANCE_BYTES = 10 + (9 * 4) + (3 * 8);
+
+// The largest blocks we write, so sizes in a damaged file can't make us
+// allocate or decode more than this
+const uint32_t MAX_CAMOUFLAGES_BLOCK_SIZE = 1U << 24;
+const uint32_t MAX_MESH_BLOCK_SIZE = 1U << 28;
+const uint32_t MAX_INSTANCES_BLOCK_SIZE =
+    10 + (INSTANCES_PER_BLOCK * MAX_INSTANCE_BYTES);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bytes
+////////////////////////////////////////////////////////////////////////////////
+
+struct ByteWriter
+{
+    std::vector<uint8_t> bytes;
+
+    void put8 (uint8_t value)
+    {
+        bytes.push_back (value);
+    }
+
+    void put32 (uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            bytes.push_back ((value >> (i * 8)) & 0xff);
+    }
+
+    void put_float (float value)
+    {
+        uint32_t bits;
+        std::memcpy (& bits, & value, sizeof (bits));
+        put32 (bits);
+    }
+
+    void put_varint (uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            bytes.push_back ((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        bytes.push_back (value);
+    }
+
+    void put_signed (int64_t value)
+    {
+        put_varint ((((uint64_t) value) << 1) ^ (uint64_t) (value >> 63));
+    }
+
+    void put_string (const std::string & value)
+    {
+        put_varint (value.size ());
+        bytes.insert (bytes.end (), value.begin (), value.end ());
+    }
+};
+
+// Reads past the end give zeros and clear ok, so callers can check once
+
+struct ByteReader
+{
+    const uint8_t * position;
+    const uint8_t * end;
+    bool ok;
+
+    ByteReader (const std::vector<uint8_t> & bytes)
+        : position (bytes.empty () ? NULL : & bytes[0]),
+          end (bytes.empty () ? NULL : & bytes[0] + bytes.size ()),
+          ok (true)
+    {}
+
+    uint8_t get8 ()
+    {
+        if (position >= end)
+        {
+            ok = false;
+            return 0;
+        }
+        return * position++;
+    }
+
+    uint32_t get32 ()
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++)
+            value |= ((uint32_t) get8 ()) << (i * 8);
+        return value;
+    }
+
+    float get_float ()
+    {
+        uint32_t bits = get32 ();
+        float value;
+        std::memcpy (& value, & bits, sizeof (value));
+        return value;
+    }
+
+    uint64_t get_varint ()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            uint8_t byte = get8 ();
+            value |= ((uint64_t) (byte & 0x7f)) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    int64_t get_signed ()
+    {
+        uint64_t value = get_varint ();
+        return (int64_t) (value >> 1) ^ - (int64_t) (value & 1);
+    }
+
+    std::string get_string ()
+    {
+        uint64_t length = get_varint ();
+        if (length > (uint64_t) (end - position))
+        {
+            ok = false;
+            return "";
+        }
+        std::string value ((const char *) position, length);
+        position += length;
+        return value;
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Entropy coding
+// Order 0 rANS over bytes, after Fabian Giesen's public domain rans_byte.h.
+////////////////////////////////////////////////////////////////////////////////
+
+const uint32_t RANS_SCALE_BITS = 12;
+const uint32_t RANS_SCALE = 1 << RANS_SCALE_BITS;
+const uint32_t RANS_LOW = 1U << 23;
+// No symbol but the only one has a frequency over RANS_SCALE - 1, so takes
+// less than log2 (RANS_SCALE / (RANS_SCALE - 1)) bits, which bounds how many
+// bytes each coded byte can hold. We don't code blocks of one repeated byte
+// so long that they would go over it.
+const uint32_t RANS_MAX_EXPANSION = RANS_SCALE * 8;
+
+// Scale counts to sum to RANS_SCALE, keeping every symbol that occurs
+
+void normalize_frequencies (const std::vector<uint8_t> & bytes,
+                            uint32_t frequencies[256])
+{
+    uint64_t counts[256] = {0};
+    for (size_t i = 0; i < bytes.size (); i++)
+        counts[bytes[i]]++;
+    uint32_t sum = 0;
+    for (int s = 0; s < 256; s++)
+    {
+        frequencies[s] = (uint32_t) ((counts[s] * RANS_SCALE) / bytes.size ());
+        if ((counts[s] > 0) && (frequencies[s] == 0))
+            frequencies[s] = 1;
+        sum += frequencies[s];
+    }
+    // Take any excess from, or give any shortfall to, the commonest symbols
+    while (sum != RANS_SCALE)
+    {
+        int largest = 0;
+        for (int s = 1; s < 256; s++)
+            if (frequencies[s] > frequencies[largest])
+                largest = s;
+        if (sum > RANS_SCALE)
+        {
+            uint32_t take = std::min (sum - RANS_SCALE,
+                                      frequencies[largest] - 1);
+            frequencies[largest] -= take;
+            sum -= take;
+            if (take == 0)
+                break;
+        }
+        else
+        {
+            frequencies[largest] += RANS_SCALE - sum;
+            sum = RANS_SCALE;
+        }
+    }
+}
+
+// Returns false if the bytes can't be coded this way
+
+bool rans_encode (const std::vector<uint8_t> & bytes, ByteWriter & out)
+{
+    if (bytes.empty ())
+        return false;
+    uint32_t frequencies[256];
+    normalize_frequencies (bytes, frequencies);
+    uint32_t cumulative[256];
+    uint32_t sum = 0;
+    int symbols = 0;
+    for (int s = 0; s < 256; s++)
+    {
+        cumulative[s] = sum;
+        sum += frequencies[s];
+        if (frequencies[s] > 0)
+            symbols++;
+    }
+    if (sum != RANS_SCALE)
+        return false;
+
+    out.put_varint (symbols);
+    for (int s = 0; s < 256; s++)
+    {
+        if (frequencies[s] > 0)
+        {
+            out.put8 (s);
+            out.put_varint (frequencies[s]);
+        }
+    }
+
+    // Encode backwards so the decoder can go forwards, then reverse the
+    // output so the decoder can read it forwards too
+    std::vector<uint8_t> reversed;
+    reversed.reserve (bytes.size () / 2);
+    uint32_t state = RANS_LOW;
+    for (size_t i = bytes.size (); i > 0; i--)
+    {
+        uint8_t symbol = bytes[i - 1];
+        uint32_t frequency = frequencies[symbol];
+        uint32_t limit = ((RANS_LOW >> RANS_SCALE_BITS) << 8) * frequency;
+        while (state >= limit)
+        {
+            reversed.push_back (state & 0xff);
+            state >>= 8;
+        }
+        state = ((state / frequency) << RANS_SCALE_BITS) +
+            (state % frequency) + cumulative[symbol];
+    }
+    for (int i = 0; i < 4; i++)
+        reversed.push_back ((state >> (i * 8)) & 0xff);
+    out.bytes.insert (out.bytes.end (), reversed.rbegin (), reversed.rend ());
+    return true;
+}
+
+bool rans_decode (ByteReader & in, size_t size, std::vector<uint8_t> & bytes)
+{
+    uint32_t frequencies[256] = {0};
+    uint64_t symbols = in.get_varint ();
+    if (symbols > 256)
+        return false;
+    for (uint64_t i = 0; i < symbols; i++)
+    {
+        uint8_t symbol = in.get8 ();
+        uint64_t frequency = in.get_varint ();
+        if (frequency > RANS_SCALE)
+            return false;
+        frequencies[symbol] = frequency;
+    }
+    uint32_t cumulative[256];
+    uint32_t sum = 0;
+    for (int s = 0; s < 256; s++)
+    {
+        cumulative[s] = sum;
+        sum += frequencies[s];
+    }
+    if ((! in.ok) || (sum != RANS_SCALE))
+        return false;
+    uint8_t slots[RANS_SCALE];
+    for (int s = 0; s < 256; s++)
+        for (uint32_t slot = cumulative[s]; slot < cumulative[s] + frequencies[s];
+             slot++)
+            slots[slot] = s;
+
+    uint32_t state = 0;
+    for (int i = 0; i < 4; i++)
+        state = (state << 8) | in.get8 ();
+    // The encoder never leaves the state below RANS_LOW, and renormalizing
+    // from zero would never finish
+    if ((! in.ok) || (state < RANS_LOW))
+        return false;
+    bytes.resize (size);
+    for (size_t i = 0; i < size; i++)
+    {
+        uint32_t slot = state & (RANS_SCALE - 1);
+        uint8_t symbol = slots[slot];
+        bytes[i] = symbol;
+        state = (frequencies[symbol] * (state >> RANS_SCALE_BITS)) + slot
+            - cumulative[symbol];
+        while (in.ok && (state < RANS_LOW))
+            state = (state << 8) | in.get8 ();
+        if (! in.ok)
+            return false;
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Quantization
+////////////////////////////////////////////////////////////////////////////////
+
+uint32_t quantize (float value, float minimum, float range, int bits)
+{
+    uint32_t steps = (1U << bits) - 1;
+    if (range <= 0.0f)
+        return 0;
+    double scaled = ((value - minimum) / range) * steps;
+    scaled = std::max (0.0, std::min (scaled, (double) steps));
+    return (uint32_t) (scaled + 0.5);
+}
+
+float dequantize (uint32_t value, float minimum, float range, int bits)
+{
+    uint32_t steps = (1U << bits) - 1;
+    return minimum + ((value * range) / steps);
+}
+
+float sign_not_zero (float value)
+{
+    return (value < 0.0f) ? -1.0f : 1.0f;
+}
+
+// Project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half
+// over the upper, giving two values in [-1, 1]
+
+void octahedral_encode (const float * normal, uint32_t encoded[2])
+{
+    float x = normal[0];
+    float y = normal[1];
+    float z = normal[2];
+    float length = std::fabs (x) + std::fabs (y) + std::fabs (z);
+    if (length == 0.0f)
+    {
+        x = 0.0f;
+        y = 0.0f;
+        z = 1.0f;
+        length = 1.0f;
+    }
+    x /= length;
+    y /= length;
+    if (z < 0.0f)
+    {
+        float folded_x = (1.0f - std::fabs (y)) * sign_not_zero (x);
+        float folded_y = (1.0f - std::fabs (x)) * sign_not_zero (y);
+        x = folded_x;
+        y = folded_y;
+    }
+    encoded[0] = quantize (x, -1.0f, 2.0f, NORMAL_BITS);
+    encoded[1] = quantize (y, -1.0f, 2.0f, NORMAL_BITS);
+}
+
+void octahedral_decode (const uint32_t encoded[2], float * normal)
+{
+    float x = dequantize (encoded[0], -1.0f, 2.0f, NORMAL_BITS);
+    float y = dequantize (encoded[1], -1.0f, 2.0f, NORMAL_BITS);
+    float z = 1.0f - std::fabs (x) - std::fabs (y);
+    if (z < 0.0f)
+    {
+        float unfolded_x = (1.0f - std::fabs (y)) * sign_not_zero (x);
+        float unfolded_y = (1.0f - std::fabs (x)) * sign_not_zero (y);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+    float length = std::sqrt ((x * x) + (y * y) + (z * z));
+    normal[0] = x / length;
+    normal[1] = y / length;
+    normal[2] = z / length;
+}
+
+// Write each stream of quantized values as the difference from the last
+
+void put_deltas (ByteWriter & out, const std::vector<uint32_t> & values,
+                 int stride)
+{
+    for (int component = 0; component < stride; component++)
+    {
+        int64_t previous = 0;
+        for (size_t i = component; i < values.size (); i += stride)
+        {
+            out.put_signed ((int64_t) values[i] - previous);
+            previous = values[i];
+        }
+    }
+}
+
+void get_deltas (ByteReader & in, std::vector<uint32_t> & values, size_t count,
+                 int stride)
+{
+    values.resize (count * stride);
+    for (int component = 0; component < stride; component++)
+    {
+        // Unsigned so that deltas from a damaged file wrap harmlessly
+        uint64_t previous = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            previous += (uint64_t) in.get_signed ();
+            values[(i * stride) + component] = (uint32_t) previous;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Block contents
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t mesh_raw_bytes (const CodecMesh & mesh)
+{
+    return ((mesh.positions.size () + mesh.normals.size () +
+             mesh.texcoords.size ()) * sizeof (float)) +
+        (mesh.indices.size () * sizeof (uint32_t));
+}
+
+const uint64_t INSTANCE_RAW_BYTES = sizeof (CodecInstance);
+
+void encode_camouflages (const std::vector<std::string> & camouflages,
+                         ByteWriter & out)
+{
+    out.put_varint (camouflages.size ());
+    for (size_t i = 0; i < camouflages.size (); i++)
+        out.put_string (camouflages[i]);
+}
+
+bool decode_camouflages (ByteReader & in, std::vector<std::string> & camouflages)
+{
+    uint64_t count = in.get_varint ();
+    for (uint64_t i = 0; in.ok && (i < count); i++)
+        camouflages.push_back (in.get_string ());
+    return in.ok;
+}
+
+void encode_mesh (const CodecMesh & mesh, int position_bits, ByteWriter & out)
+{
+    size_t vertices = mesh.positions.size () / 3;
+    bool has_normals = mesh.normals.size () == vertices * 3;
+    bool has_texcoords = mesh.texcoords.size () == vertices * 2;
+
+    out.put_varint (mesh.payload);
+    for (int i = 0; i < 3; i++)
+        out.put_float (mesh.center[i]);
+    out.put_float (mesh.radius);
+    out.put8 (position_bits);
+    out.put8 ((has_normals ? MESH_NORMALS : 0) |
+              (has_texcoords ? MESH_TEXCOORDS : 0));
+    out.put_varint (vertices);
+    out.put_varint (mesh.indices.size ());
+
+    std::vector<uint32_t> quantized (vertices * 3);
+    for (size_t i = 0; i < vertices * 3; i++)
+        quantized[i] = quantize (mesh.positions[i],
+                                 mesh.center[i % 3] - mesh.radius,
+                                 mesh.radius * 2.0f, position_bits);
+    put_deltas (out, quantized, 3);
+
+    if (has_normals)
+    {
+        quantized.resize (vertices * 2);
+        for (size_t i = 0; i < vertices; i++)
+            octahedral_encode (& mesh.normals[i * 3], & quantized[i * 2]);
+        put_deltas (out, quantized, 2);
+    }
+
+    if (has_texcoords)
+    {
+        float minimum[2] = {mesh.texcoords[0], mesh.texcoords[1]};
+        float maximum[2] = {mesh.texcoords[0], mesh.texcoords[1]};
+        for (size_t i = 0; i < vertices * 2; i++)
+        {
+            minimum[i % 2] = std::min (minimum[i % 2], mesh.texcoords[i]);
+            maximum[i % 2] = std::max (maximum[i % 2], mesh.texcoords[i]);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            out.put_float (minimum[i]);
+            out.put_float (maximum[i]);
+        }
+        quantized.resize (vertices * 2);
+        for (size_t i = 0; i < vertices * 2; i++)
+            quantized[i] = quantize (mesh.texcoords[i], minimum[i % 2],
+                                     maximum[i % 2] - minimum[i % 2],
+                                     TEXCOORD_BITS);
+        put_deltas (out, quantized, 2);
+    }
+
+    // Vertex cache ordering keeps neighbouring indices close together
+    put_deltas (out, mesh.indices, 1);
+}
+
+bool decode_mesh (ByteReader & in, CodecMesh & mesh)
+{
+    mesh.payload = in.get_varint ();
+    for (int i = 0; i < 3; i++)
+        mesh.center[i] = in.get_float ();
+    mesh.radius = in.get_float ();
+    int position_bits = in.get8 ();
+    int flags = in.get8 ();
+    uint64_t vertices = in.get_varint ();
+    uint64_t indices = in.get_varint ();
+    // Every value takes at least a byte, which bounds the counts
+    uint64_t remaining = in.end - in.position;
+    uint64_t vertex_bytes = 3 + ((flags & MESH_NORMALS) ? 2 : 0) +
+        ((flags & MESH_TEXCOORDS) ? 2 : 0);
+    if ((! in.ok) || (position_bits < 1) || (position_bits > 24) ||
+        (vertices > (remaining / vertex_bytes)) ||
+        (indices > (remaining - (vertices * vertex_bytes))))
+        return false;
+
+    std::vector<uint32_t> quantized;
+    get_deltas (in, quantized, vertices, 3);
+    mesh.positions.resize (vertices * 3);
+    for (size_t i = 0; i < vertices * 3; i++)
+        mesh.positions[i] = dequantize (quantized[i],
+                                        mesh.center[i % 3] - mesh.radius,
+                                        mesh.radius * 2.0f, position_bits);
+
+    if (flags & MESH_NORMALS)
+    {
+        get_deltas (in, quantized, vertices, 2);
+        mesh.normals.resize (vertices * 3);
+        for (size_t i = 0; i < vertices; i++)
+            octahedral_decode (& quantized[i * 2], & mesh.normals[i * 3]);
+    }
+
+    if (flags & MESH_TEXCOORDS)
+    {
+        float minimum[2], maximum[2];
+        for (int i = 0; i < 2; i++)
+        {
+            minimum[i] = in.get_float ();
+            maximum[i] = in.get_float ();
+        }
+        get_deltas (in, quantized, vertices, 2);
+        mesh.texcoords.resize (vertices * 2);
+        for (size_t i = 0; i < vertices * 2; i++)
+            mesh.texcoords[i] = dequantize (quantized[i], minimum[i % 2],
+                                            maximum[i % 2] - minimum[i % 2],
+                                            TEXCOORD_BITS);
+    }
+
+    get_deltas (in, mesh.indices, indices, 1);
+    for (size_t i = 0; i < mesh.indices.size (); i++)
+        if (mesh.indices[i] >= vertices)
+            return false;
+    return in.ok;
+}
+
+// Matrices are written a component at a time and a byte at a time, so the
+// similar exponent bytes of many matrices end up next to each other
+
+void encode_instances (const CodecInstance * instances, size_t count,
+                       ByteWriter & out)
+{
+    out.put_varint (count);
+    uint32_t previous = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        out.put_signed ((int64_t) instances[i].payload - previous);
+        previous = instances[i].payload;
+    }
+    previous = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        out.put_signed ((int64_t) instances[i].camouflage - previous);
+        previous = instances[i].camouflage;
+    }
+    for (int byte = 0; byte < 4; byte++)
+    {
+        for (int element = 0; element < 9; element++)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                uint32_t bits;
+                std::memcpy (& bits, & instances[i].rotation[element],
+                             sizeof (bits));
+                out.put8 ((bits >> (byte * 8)) & 0xff);
+            }
+        }
+    }
+    for (int byte = 0; byte < 8; byte++)
+    {
+        for (int element = 0; element < 3; element++)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                uint64_t bits;
+                std::memcpy (& bits, & instances[i].translation[element],
+                             sizeof (bits));
+                out.put8 ((bits >> (byte * 8)) & 0xff);
+            }
+        }
+    }
+}
+
+bool decode_instances (ByteReader & in, std::vector<CodecInstance> & instances)
+{
+    uint64_t count = in.get_varint ();
+    if ((! in.ok) ||
+        (count > ((uint64_t) (in.end - in.position) / MIN_INSTANCE_BYTES)))
+        return false;
+    instances.resize (count);
+    uint64_t previous = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        previous += (uint64_t) in.get_signed ();
+        instances[i].payload = (uint32_t) previous;
+    }
+    previous = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        previous += (uint64_t) in.get_signed ();
+        instances[i].camouflage = (uint32_t) previous;
+    }
+    std::vector<uint32_t> rotation_bits (count * 9, 0);
+    for (int byte = 0; byte < 4; byte++)
+        for (int element = 0; element < 9; element++)
+            for (size_t i = 0; i < count; i++)
+                rotation_bits[(i * 9) + element] |=
+                    ((uint32_t) in.get8 ()) << (byte * 8);
+    std::vector<uint64_t> translation_bits (count * 3, 0);
+    for (int byte = 0; byte < 8; byte++)
+        for (int element = 0; element < 3; element++)
+            for (size_t i = 0; i < count; i++)
+                translation_bits[(i * 3) + element] |=
+                    ((uint64_t) in.get8 ()) << (byte * 8);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::memcpy (instances[i].rotation, & rotation_bits[i * 9],
+                     sizeof (instances[i].rotation));
+        std::memcpy (instances[i].translation, & translation_bits[i * 3],
+                     sizeof (instances[i].translation));
+    }
+    return in.ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Blocks
+////////////////////////////////////////////////////////////////////////////////
+
+double seconds_now ()
+{
+    struct timeval now;
+    gettimeofday (& now, NULL);
+    return now.tv_sec + (now.tv_usec / 1000000.0);
+}
+
+uint32_t max_block_size (int type)
+{
+    switch (type)
+    {
+    case BLOCK_END:
+        return 0;
+    case BLOCK_CAMOUFLAGES:
+        return MAX_CAMOUFLAGES_BLOCK_SIZE;
+    case BLOCK_MESH:
+        return MAX_MESH_BLOCK_SIZE;
+    case BLOCK_INSTANCES:
+        return MAX_INSTANCES_BLOCK_SIZE;
+    }
+    // Blocks from later versions are skipped without being decoded
+    return 0;
+}
+
+bool write_block (FILE * file, BlockType type, const ByteWriter & contents,
+                  CodecStatistics & statistics)
+{
+    if (contents.bytes.size () > max_block_size (type))
+    {
+        std::fprintf (stderr, "Block of %lu bytes is too large to write.\n",
+                      (unsigned long) contents.bytes.size ());
+        return false;
+    }
+    ByteWriter coded;
+    bool use_rans = rans_encode (contents.bytes, coded) &&
+        (coded.bytes.size () < contents.bytes.size ()) &&
+        ((contents.bytes.size () / RANS_MAX_EXPANSION) <= coded.bytes.size ());
+    const std::vector<uint8_t> & stored =
+        use_rans ? coded.bytes : contents.bytes;
+
+    ByteWriter header;
+    header.put8 (type);
+    header.put8 (use_rans ? METHOD_RANS : METHOD_STORED);
+    header.put32 (contents.bytes.size ());
+    header.put32 (stored.size ());
+    statistics.encoded_bytes += header.bytes.size () + stored.size ();
+    return (std::fwrite (& header.bytes[0], 1, header.bytes.size (), file)
+            == header.bytes.size ()) &&
+        (stored.empty () ||
+         (std::fwrite (& stored[0], 1, stored.size (), file) == stored.size ()));
+}
+
+bool read_block (FILE * file, int & type, std::vector<uint8_t> & contents,
+                 CodecStatistics & statistics)
+{
+    std::vector<uint8_t> header (10);
+    if (std::fread (& header[0], 1, header.size (), file) != header.size ())
+        return false;
+    ByteReader header_reader (header);
+    type = header_reader.get8 ();
+    int method = header_reader.get8 ();
+    uint32_t raw_size = header_reader.get32 ();
+    uint32_t stored_size = header_reader.get32 ();
+    bool known = (type == BLOCK_END) || (type == BLOCK_CAMOUFLAGES) ||
+        (type == BLOCK_MESH) || (type == BLOCK_INSTANCES);
+    if (! known)
+    {
+        contents.clear ();
+        statistics.encoded_bytes += header.size () + stored_size;
+        return std::fseek (file, stored_size, SEEK_CUR) == 0;
+    }
+    // Stored contents are never larger than the raw contents
+    if ((raw_size > max_block_size (type)) || (stored_size > raw_size))
+        return false;
+
+    std::vector<uint8_t> stored (stored_size);
+    if ((stored_size > 0) &&
+        (std::fread (& stored[0], 1, stored_size, file) != stored_size))
+        return false;
+    statistics.encoded_bytes += header.size () + stored_size;
+
+    if (method == METHOD_STORED)
+    {
+        contents.swap (stored);
+        return contents.size () == raw_size;
+    }
+    if (method == METHOD_RANS)
+    {
+        // Otherwise a few bytes could make us decode up to the size limit
+        if ((raw_size / RANS_MAX_EXPANSION) > stored_size)
+            return false;
+        ByteReader reader (stored);
+        return rans_decode (reader, raw_size, contents);
+    }
+    return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Scenes
+////////////////////////////////////////////////////////////////////////////////
+
+bool write_compressed_scene (const std::string & filename,
+                             const CodecScene & scene, int position_bits,
+                             CodecStatistics & statistics)
+{
+    double start = seconds_now ();
+    FILE * file = std::fopen (filename.c_str (), "wb");
+    if (file == NULL)
+        return false;
+    statistics = CodecStatistics ();
+    bool ok = std::fwrite (CODEC_MAGIC, sizeof (CODEC_MAGIC), 1, file) == 1;
+    statistics.encoded_bytes += sizeof (CODEC_MAGIC);
+
+    ByteWriter camouflages;
+    encode_camouflages (scene.camouflages, camouflages);
+    ok = ok && write_block (file, BLOCK_CAMOUFLAGES, camouflages, statistics);
+
+    std::map<uint32_t, uint64_t> payload_bytes;
+    for (size_t i = 0; ok && (i < scene.meshes.size ()); i++)
+    {
+        ByteWriter mesh;
+        encode_mesh (scene.meshes[i], position_bits, mesh);
+        ok = write_block (file, BLOCK_MESH, mesh, statistics);
+        payload_bytes[scene.meshes[i].payload] +=
+            mesh_raw_bytes (scene.meshes[i]);
+        statistics.raw_bytes += mesh_raw_bytes (scene.meshes[i]);
+    }
+
+    for (size_t begin = 0; ok && (begin < scene.instances.size ());
+         begin += INSTANCES_PER_BLOCK)
+    {
+        size_t count = std::min (INSTANCES_PER_BLOCK,
+                                 scene.instances.size () - begin);
+        ByteWriter instances;
+        encode_instances (& scene.instances[begin], count, instances);
+        ok = write_block (file, BLOCK_INSTANCES, instances, statistics);
+    }
+    for (size_t i = 0; i < scene.instances.size (); i++)
+        statistics.expanded_bytes += payload_bytes[scene.instances[i].payload];
+    statistics.raw_bytes += scene.instances.size () * INSTANCE_RAW_BYTES;
+
+    ByteWriter end;
+    ok = ok && write_block (file, BLOCK_END, end, statistics);
+    ok = (std::fclose (file) == 0) && ok;
+    statistics.seconds = seconds_now () - start;
+    return ok;
+}
+
+bool read_compressed_scene (const std::string & filename, CodecReader & reader,
+                            CodecStatistics & statistics)
+{
+    double start = seconds_now ();
+    FILE * file = std::fopen (filename.c_str (), "rb");
+    if (file == NULL)
+        return false;
+    statistics = CodecStatistics ();
+    char magic[sizeof (CODEC_MAGIC)];
+    bool ok = (std::fread (magic, sizeof (magic), 1, file) == 1) &&
+        (std::memcmp (magic, CODEC_MAGIC, sizeof (magic)) == 0);
+    statistics.encoded_bytes += sizeof (CODEC_MAGIC);
+
+    std::map<uint32_t, uint64_t> payload_bytes;
+    std::vector<uint8_t> contents;
+    int type = BLOCK_END;
+    while (ok && read_block (file, type, contents, statistics) &&
+           (type != BLOCK_END))
+    {
+        ByteReader in (contents);
+        if (type == BLOCK_CAMOUFLAGES)
+        {
+            std::vector<std::string> camouflages;
+            ok = decode_camouflages (in, camouflages);
+            for (size_t i = 0; ok && (i < camouflages.size ()); i++)
+                reader.camouflage (camouflages[i]);
+        }
+        else if (type == BLOCK_MESH)
+        {
+            CodecMesh mesh;
+            ok = decode_mesh (in, mesh);
+            if (ok)
+            {
+                payload_bytes[mesh.payload] += mesh_raw_bytes (mesh);
+                statistics.raw_bytes += mesh_raw_bytes (mesh);
+                reader.mesh (mesh);
+            }
+        }
+        else if (type == BLOCK_INSTANCES)
+        {
+            std::vector<CodecInstance> instances;
+            ok = decode_instances (in, instances);
+            if (ok)
+            {
+                for (size_t i = 0; i < instances.size (); i++)
+                    statistics.expanded_bytes +=
+                        payload_bytes[instances[i].payload];
+                statistics.raw_bytes += instances.size () * INSTANCE_RAW_BYTES;
+                reader.instances (instances);
+            }
+        }
+        // Skip blocks from later versions that we don't know
+    }
+    ok = ok && (type == BLOCK_END);
+    std::fclose (file);
+    statistics.seconds = seconds_now () - start;
+    return ok;
+}
+
+void print_codec_statistics (const char * action,
+                             const CodecStatistics & statistics)
+{
+    double encoded = std::max ((double) statistics.encoded_bytes, 1.0);
+    double seconds = std::max (statistics.seconds, 1e-9);
+    std::fprintf (stderr, "%s %llu bytes in %.3f seconds.\n", action,
+                  (unsigned long long) statistics.encoded_bytes,
+                  statistics.seconds);
+    std::fprintf (stderr, "Compression ratio %.1f:1 against full precision "
+                  "geometry for every delivery (%llu bytes),\n"
+                  "%.1f:1 against full precision geometry per payload "
+                  "(%llu bytes).\n",
+                  statistics.expanded_bytes / encoded,
+                  (unsigned long long) statistics.expanded_bytes,
+                  statistics.raw_bytes / encoded,
+                  (unsigned long long) statistics.raw_bytes);
+    std::fprintf (stderr, "Throughput %.1f MB/s of per payload geometry, "
+                  "%.1f MB/s of compressed data.\n",
+                  (statistics.raw_bytes / seconds) / (1024.0 * 1024.0),
+                  (statistics.encoded_bytes / seconds) / (1024.0 * 1024.0));
+}
@@ -0,0 +1,105 @@
+/*
+    Surgical Strike (Free Software Version).
+    Copyright (C) 2008, 2014 Rob Myers
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SURGICAL_STRIKE_CODEC_H__
+#define __SURGICAL_STRIKE_CODEC_H__
+
+// The compressed scene format (.ssc).
+// Each payload's geometry is stored once, with positions quantized within
+// its bounding sphere, normals octahedrally encoded and everything delta
+// coded, and each delivery is stored as a payload, a camouflage and a
+// matrix. The file is a header followed by independently entropy coded
+// blocks, so it can be decoded a block at a time.
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Part of a payload's geometry, in the payload's own coordinates
+
+struct CodecMesh
+{
+    uint32_t payload;
+    // The payload's bounding sphere, which positions are quantized within
+    float center[3];
+    float radius;
+    // x y z per vertex
+    std::vector<float> positions;
+    // x y z per vertex, or empty
+    std::vector<float> normals;
+    // s t per vertex, or empty
+    std::vector<float> texcoords;
+    // Three per triangle
+    std::vector<uint32_t> indices;
+};
+
+struct CodecInstance
+{
+    uint32_t payload;
+    // 0 for none, otherwise 1 + the index of the camouflage's file name
+    uint32_t camouflage;
+    // The three rows of the 3x3 part of the matrix
+    float rotation[9];
+    // Kept at full precision, as deliveries can be far from the origin
+    double translation[3];
+};
+
+struct CodecScene
+{
+    std::vector<std::string> camouflages;
+    std::vector<CodecMesh> meshes;
+    std::vector<CodecInstance> instances;
+};
+
+struct CodecStatistics
+{
+    // Full precision geometry repeated for every delivery, as other formats
+    // store it
+    uint64_t expanded_bytes;
+    // Full precision geometry stored once per payload, plus the deliveries
+    uint64_t raw_bytes;
+    uint64_t encoded_bytes;
+    double seconds;
+
+    CodecStatistics ()
+        : expanded_bytes (0), raw_bytes (0), encoded_bytes (0), seconds (0.0)
+    {}
+};
+
+// Called with each block as it is decoded
+
+struct CodecReader
+{
+    virtual ~CodecReader () {}
+    virtual void camouflage (const std::string & filename) = 0;
+    virtual void mesh (const CodecMesh & mesh) = 0;
+    virtual void instances (const std::vector<CodecInstance> & instances) = 0;
+};
+
+bool write_compressed_scene (const std::string & filename,
+                             const CodecScene & scene, int position_bits,
+                             CodecStatistics & statistics);
+
+bool read_compressed_scene (const std::string & filename, CodecReader & reader,
+                            CodecStatistics & statistics);
+
+void print_codec_statistics (const char * action,
+                             const CodecStatistics & statistics);
+
+#endif
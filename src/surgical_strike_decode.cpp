@@ -0,0 +1,264 @@
+/*
+  Surgical Strike (Free Software Version).
+  Copyright (C) 2008, 2014 Rob Myers
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Reads the compressed scenes (.ssc) written by surgical_strike, and
+// optionally writes them out again in any format osgDB can write.
+// Deliveries are built as surgical_strike builds them, except that they
+// share their payload's node rather than each having a copy.
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Group>
+#include <osg/LightModel>
+#include <osg/MatrixTransform>
+#include <osg/Node>
+#include <osg/PrimitiveSet>
+#include <osg/TexGen>
+#include <osg/Texture2D>
+
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+
+#include "surgical_strike_codec.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Building the scene
+////////////////////////////////////////////////////////////////////////////////
+
+struct SceneBuilder : public CodecReader
+{
+    osg::ref_ptr<osg::Group> theater;
+    std::map<uint32_t, osg::ref_ptr<osg::Geode> > payloads;
+    std::vector<osg::ref_ptr<osg::Texture2D> > camouflages;
+    unsigned long deliveries;
+
+    SceneBuilder ()
+        : theater (new osg::Group),
+          deliveries (0)
+    {}
+
+    virtual void camouflage (const std::string & filename)
+    {
+        osg::ref_ptr<osg::Texture2D> texture;
+        osg::Image * image = osgDB::readImageFile (filename);
+        if (image == NULL)
+        {
+            std::fprintf (stderr, "Couldn't load camouflage %s, "
+                          "delivering without it.\n", filename.c_str ());
+        }
+        else
+        {
+            texture = new osg::Texture2D;
+            texture->setName (filename);
+            texture->setFilter (osg::Texture::MIN_FILTER,
+                                osg::Texture::LINEAR_MIPMAP_LINEAR);
+            texture->setFilter (osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+            texture->setWrap (osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+            texture->setWrap (osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+            texture->setImage (image);
+        }
+        camouflages.push_back (texture);
+    }
+
+    virtual void mesh (const CodecMesh & mesh)
+    {
+        size_t count = mesh.positions.size () / 3;
+        osg::Geometry * geometry = new osg::Geometry;
+
+        osg::Vec3Array * vertices = new osg::Vec3Array (count);
+        for (size_t i = 0; i < count; i++)
+            (* vertices)[i].set (mesh.positions[i * 3],
+                                 mesh.positions[(i * 3) + 1],
+                                 mesh.positions[(i * 3) + 2]);
+        geometry->setVertexArray (vertices);
+
+        if (! mesh.normals.empty ())
+        {
+            osg::Vec3Array * normals = new osg::Vec3Array (count);
+            for (size_t i = 0; i < count; i++)
+                (* normals)[i].set (mesh.normals[i * 3],
+                                    mesh.normals[(i * 3) + 1],
+                                    mesh.normals[(i * 3) + 2]);
+            geometry->setNormalArray (normals, osg::Array::BIND_PER_VERTEX);
+        }
+
+        if (! mesh.texcoords.empty ())
+        {
+            osg::Vec2Array * texcoords = new osg::Vec2Array (count);
+            for (size_t i = 0; i < count; i++)
+                (* texcoords)[i].set (mesh.texcoords[i * 2],
+                                      mesh.texcoords[(i * 2) + 1]);
+            geometry->setTexCoordArray (0, texcoords,
+                                        osg::Array::BIND_PER_VERTEX);
+        }
+
+        osg::DrawElementsUInt * triangles =
+            new osg::DrawElementsUInt (osg::PrimitiveSet::TRIANGLES,
+                                       mesh.indices.begin (),
+                                       mesh.indices.end ());
+        geometry->addPrimitiveSet (triangles);
+
+        if (! payloads[mesh.payload].valid ())
+            payloads[mesh.payload] = new osg::Geode;
+        payloads[mesh.payload]->addDrawable (geometry);
+    }
+
+    // As Deliver does in surgical_strike
+
+    void camouflage_delivery (osg::MatrixTransform * target,
+                              osg::Geode * payload,
+                              osg::Texture2D * texture)
+    {
+        osg::StateSet * stateset = target->getOrCreateStateSet ();
+        osg::ref_ptr<osg::LightModel> lightModel = new osg::LightModel;
+        lightModel->setTwoSided(true);
+        stateset->setAttributeAndModes(lightModel.get());
+
+        stateset->setTextureAttributeAndModes (0, texture,
+                                               osg::StateAttribute::ON
+                                               | osg::StateAttribute::OVERRIDE);
+
+        osg::ref_ptr<osg::TexGen> texGen(new osg::TexGen());
+        const osg::BoundingSphere & bounds = payload->getBound();
+        float factor = 1.0 / bounds.radius();
+        texGen->setPlane(osg::TexGen::S, osg::Plane(factor, 0.0, 0.0, 0.5));
+        texGen->setPlane(osg::TexGen::T, osg::Plane(0.0, factor, 0.0, 0.5));
+        stateset->setTextureAttributeAndModes(0, texGen);
+    }
+
+    virtual void instances (const std::vector<CodecInstance> & instances)
+    {
+        for (size_t i = 0; i < instances.size (); i++)
+        {
+            const CodecInstance & instance = instances[i];
+            const float * r = instance.rotation;
+            const double * t = instance.translation;
+            osg::Matrixd transform (r[0], r[1], r[2], 0.0,
+                                    r[3], r[4], r[5], 0.0,
+                                    r[6], r[7], r[8], 0.0,
+                                    t[0], t[1], t[2], 1.0);
+            osg::MatrixTransform * target = new osg::MatrixTransform (transform);
+            // Payloads with no triangles have no geode
+            if (! payloads[instance.payload].valid ())
+                payloads[instance.payload] = new osg::Geode;
+            osg::Geode * payload = payloads[instance.payload].get ();
+            target->addChild (payload);
+            if ((instance.camouflage > 0) &&
+                (instance.camouflage <= camouflages.size ()) &&
+                camouflages[instance.camouflage - 1].valid ())
+                camouflage_delivery (target, payload,
+                                     camouflages[instance.camouflage - 1].get ());
+            theater->addChild (target);
+            deliveries++;
+        }
+    }
+};
+
+// Just counts, to measure decoding on its own
+
+struct DecodeOnly : public CodecReader
+{
+    unsigned long meshes;
+    unsigned long deliveries;
+
+    DecodeOnly ()
+        : meshes (0),
+          deliveries (0)
+    {}
+
+    virtual void camouflage (const std::string & filename)
+    {}
+
+    virtual void mesh (const CodecMesh & mesh)
+    {
+        meshes++;
+    }
+
+    virtual void instances (const std::vector<CodecInstance> & instances)
+    {
+        deliveries += instances.size ();
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Main program lifecycle
+////////////////////////////////////////////////////////////////////////////////
+
+void usage ()
+{
+    std::printf ("Surgical Strike Free Software version 0.4\n"
+                 "USAGE:\n"
+                 "surgical_strike_decode [input file] - "
+                 "Decode a .ssc file and report how long it took\n"
+                 "surgical_strike_decode [input file] [output file] - "
+                 "Decode a .ssc file and write it as output file\n");
+}
+
+int main (int argc, char ** argv)
+{
+    if ((argc < 2) || (argc > 3) || (std::strcmp (argv[1], "--help") == 0))
+    {
+        usage ();
+        exit (argc < 2 ? 1 : 0);
+    }
+
+    CodecStatistics statistics;
+    if (argc == 2)
+    {
+        DecodeOnly counter;
+        if (! read_compressed_scene (argv[1], counter, statistics))
+        {
+            std::fprintf (stderr, "Couldn't decode file %s\n", argv[1]);
+            exit (1);
+        }
+        std::fprintf (stderr, "%lu meshes, %lu deliveries.\n",
+                      counter.meshes, counter.deliveries);
+        print_codec_statistics ("Decoded", statistics);
+        return 0;
+    }
+
+    SceneBuilder builder;
+    if (! read_compressed_scene (argv[1], builder, statistics))
+    {
+        std::fprintf (stderr, "Couldn't decode file %s\n", argv[1]);
+        exit (1);
+    }
+    print_codec_statistics ("Decoded", statistics);
+
+    std::fprintf (stderr, "Writing file %s: %lu deliveries\n", argv[2],
+                  builder.deliveries);
+    if (! osgDB::writeNodeFile (*builder.theater, argv[2]))
+    {
+        std::fprintf (stderr, "Couldn't write file %s\n", argv[2]);
+        exit (1);
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+  Surgical Strike (Free Software Version).
+  Copyright (C) 2008, 2014 Rob Myers
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Combines the partial scenes written by surgical_strike --shard i/N into
+// a single scene.
+// Deliveries named delivery-N by the shards are put back in program order,
+// whatever order the partial files are given in. Formats that don't keep
+// node names (such as obj) are merged in the order they are given.
+// Camouflage textures are shared between the partial scenes by image file
+// name, and materials by value, so the merged scene names each once.
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <osg/Geode>
+#include <osg/Group>
+#include <osg/Material>
+#include <osg/Node>
+#include <osg/NodeVisitor>
+#include <osg/StateSet>
+#include <osg/Texture2D>
+
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Ordering deliveries
+////////////////////////////////////////////////////////////////////////////////
+
+const unsigned long UNNUMBERED = (unsigned long) -1;
+
+struct Delivery
+{
+    unsigned long number;
+    unsigned long sequence;
+    osg::ref_ptr<osg::Node> node;
+};
+
+unsigned long delivery_number (const std::string & name)
+{
+    unsigned long number;
+    char end;
+    if (std::sscanf (name.c_str (), "delivery-%lu%c", &number, &end) == 1)
+        return number;
+    return UNNUMBERED;
+}
+
+// Numbered deliveries in number order, then anything else in the order read
+
+bool delivery_before (const Delivery & a, const Delivery & b)
+{
+    if (a.number != b.number)
+        return a.number < b.number;
+    return a.sequence < b.sequence;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Sharing camouflages and materials
+////////////////////////////////////////////////////////////////////////////////
+
+struct ShareState : public osg::NodeVisitor
+{
+    std::map<std::string, osg::ref_ptr<osg::Texture2D> > textures;
+    std::vector<osg::ref_ptr<osg::Material> > materials;
+
+    ShareState ()
+        : osg::NodeVisitor (osg::NodeVisitor::TRAVERSE_ALL_CHILDREN)
+    {}
+
+    std::string texture_key (osg::Texture2D * texture)
+    {
+        const osg::Image * image = texture->getImage ();
+        if ((image != NULL) && (image->getFileName () != ""))
+            return image->getFileName ();
+        return texture->getName ();
+    }
+
+    void share_texture (osg::StateSet * stateset)
+    {
+        osg::Texture2D * texture = dynamic_cast<osg::Texture2D *>
+            (stateset->getTextureAttribute (0, osg::StateAttribute::TEXTURE));
+        if (texture == NULL)
+            return;
+        std::string key = texture_key (texture);
+        if (key == "")
+            return;
+        if (textures.find (key) == textures.end ())
+        {
+            texture->setName (key);
+            textures[key] = texture;
+        }
+        else if (textures[key].get () != texture)
+        {
+            stateset->setTextureAttribute (0, textures[key].get ());
+        }
+    }
+
+    void share_material (osg::StateSet * stateset)
+    {
+        osg::Material * material = dynamic_cast<osg::Material *>
+            (stateset->getAttribute (osg::StateAttribute::MATERIAL));
+        if (material == NULL)
+            return;
+        for (size_t i = 0; i < materials.size (); i++)
+        {
+            if (materials[i].get () == material)
+                return;
+            if (materials[i]->compare (*material) == 0)
+            {
+                stateset->setAttribute (materials[i].get ());
+                return;
+            }
+        }
+        char name[32];
+        std::snprintf (name, sizeof (name), "material-%lu",
+                       (unsigned long) materials.size ());
+        material->setName (name);
+        materials.push_back (material);
+    }
+
+    void share (osg::StateSet * stateset)
+    {
+        if (stateset == NULL)
+            return;
+        share_texture (stateset);
+        share_material (stateset);
+    }
+
+    virtual void apply (osg::Node & node)
+    {
+        share (node.getStateSet ());
+        traverse (node);
+    }
+
+    virtual void apply (osg::Geode & geode)
+    {
+        share (geode.getStateSet ());
+        for (unsigned int i = 0; i < geode.getNumDrawables (); i++)
+            share (geode.getDrawable (i)->getStateSet ());
+        traverse (geode);
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Main program lifecycle
+////////////////////////////////////////////////////////////////////////////////
+
+void usage ()
+{
+    std::printf ("Surgical Strike Free Software version 0.4\n"
+                 "USAGE:\n"
+                 "surgical_strike_merge [output file] [partial file]... - "
+                 "Merge the partial files written by surgical_strike "
+                 "--shard\n");
+}
+
+int main (int argc, char ** argv)
+{
+    if ((argc < 3) || (std::strcmp (argv[1], "--help") == 0))
+    {
+        usage ();
+        exit (argc < 3 ? 1 : 0);
+    }
+
+    std::vector<Delivery> deliveries;
+    for (int i = 2; i < argc; i++)
+    {
+        std::fprintf (stderr, "Reading partial file %s\n", argv[i]);
+        osg::ref_ptr<osg::Node> partial = osgDB::readNodeFile (argv[i]);
+        if (! partial.valid ())
+        {
+            std::fprintf (stderr, "Couldn't load file %s\n", argv[i]);
+            exit (1);
+        }
+        osg::Group * group = partial->asGroup ();
+        if (group == NULL)
+        {
+            Delivery delivery;
+            delivery.number = delivery_number (partial->getName ());
+            delivery.sequence = deliveries.size ();
+            delivery.node = partial;
+            deliveries.push_back (delivery);
+            continue;
+        }
+        for (unsigned int j = 0; j < group->getNumChildren (); j++)
+        {
+            Delivery delivery;
+            delivery.number = delivery_number (group->getChild (j)->getName ());
+            delivery.sequence = deliveries.size ();
+            delivery.node = group->getChild (j);
+            deliveries.push_back (delivery);
+        }
+    }
+
+    std::stable_sort (deliveries.begin (), deliveries.end (), delivery_before);
+
+    osg::ref_ptr<osg::Group> theater = new osg::Group;
+    for (size_t i = 0; i < deliveries.size (); i++)
+        theater->addChild (deliveries[i].node.get ());
+
+    ShareState share;
+    theater->accept (share);
+
+    std::fprintf (stderr, "Writing file %s: %lu deliveries, %lu camouflages, "
+                  "%lu materials\n", argv[1],
+                  (unsigned long) deliveries.size (),
+                  (unsigned long) share.textures.size (),
+                  (unsigned long) share.materials.size ());
+    if (! osgDB::writeNodeFile (*theater, argv[1]))
+    {
+        std::fprintf (stderr, "Couldn't write file %s\n", argv[1]);
+        exit (1);
+    }
+    return 0;
+}